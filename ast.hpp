@@ -0,0 +1,316 @@
+#ifndef KALEIDOSCOPE_AST_HPP
+#define KALEIDOSCOPE_AST_HPP
+
+#include "instrument.hpp"
+#include "symbol_table.hpp"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// AST
+
+// ASTArena -- owns the expression nodes of one top-level item. Nodes
+// are bump-allocated and never destroyed one at a time; the whole
+// arena is released with the FunctionAST that owns it.
+class ASTArena {
+	llvm::BumpPtrAllocator Alloc;
+	public:
+	ASTArena() { instrument::count(instrument::C_Arenas); }
+
+	template <typename T, typename... ArgTs> T* make(ArgTs&&... Args) {
+		static_assert(std::is_trivially_destructible<T>::value,
+			"arena nodes are never destroyed");
+		instrument::count(instrument::C_ArenaAllocations);
+		instrument::count(instrument::C_ArenaBytes, sizeof(T));
+		return new (Alloc.Allocate<T>()) T(std::forward<ArgTs>(Args)...);
+	}
+
+	template <typename T> llvm::ArrayRef<T> copy(llvm::ArrayRef<T> Elts) {
+		instrument::count(instrument::C_ArenaAllocations);
+		instrument::count(instrument::C_ArenaBytes, Elts.size() * sizeof(T));
+		T* Mem = Alloc.Allocate<T>(Elts.size());
+		std::uninitialized_copy(Elts.begin(), Elts.end(), Mem);
+		return llvm::ArrayRef<T>(Mem, Elts.size());
+	}
+};
+
+// base class for all expression nodes. Built without RTTI, so each
+// node records its kind for isa<>/cast<>.
+class ExprAST {
+	public:
+		enum ExprKind {
+			EK_Number,
+			EK_Variable,
+			EK_Binary,
+			EK_Call
+		};
+		ExprKind getKind() const { return Kind; }
+	protected:
+		ExprAST(ExprKind Kind) : Kind(Kind) {
+			instrument::count(instrument::CounterID(instrument::C_NumberExprs
+				+ Kind));
+		}
+		~ExprAST() = default;
+	private:
+		const ExprKind Kind;
+};
+static_assert(instrument::C_CallExprs - instrument::C_NumberExprs ==
+	ExprAST::EK_Call - ExprAST::EK_Number,
+	"instrument counts nodes by ExprKind");
+
+// expression class for numeric literals like "1.0"
+class NumberExprAST : public ExprAST {
+	double Val;
+	public:
+	NumberExprAST(double Val) : ExprAST(EK_Number), Val(Val) {}
+	double getVal() const { return Val; }
+	static bool classof(const ExprAST* E) { return E->getKind() == EK_Number; }
+};
+
+// expression class for referencing a variable, like "a"
+class VariableExprAST : public ExprAST {
+	SymbolID Name;
+	public:
+	VariableExprAST(SymbolID Name) : ExprAST(EK_Variable), Name(Name) {}
+	SymbolID getName() const { return Name; }
+	static bool classof(const ExprAST* E) {
+		return E->getKind() == EK_Variable;
+	}
+};
+
+// expression class for a binary operator
+class BinaryExprAST : public ExprAST {
+	char Op;
+	ExprAST *LHS, *RHS;
+	public:
+	BinaryExprAST(char Op, ExprAST* LHS, ExprAST* RHS)
+		: ExprAST(EK_Binary), Op(Op), LHS(LHS), RHS(RHS) {}
+	char getOp() const { return Op; }
+	ExprAST* getLHS() const { return LHS; }
+	ExprAST* getRHS() const { return RHS; }
+	static bool classof(const ExprAST* E) { return E->getKind() == EK_Binary; }
+};
+
+// expression class for function calls
+class CallExprAST : public ExprAST {
+	SymbolID Callee;
+	llvm::ArrayRef<ExprAST*> Args;  // stored in the same arena
+	public:
+	CallExprAST(SymbolID Callee, llvm::ArrayRef<ExprAST*> Args)
+		: ExprAST(EK_Call), Callee(Callee), Args(Args) {}
+	SymbolID getCallee() const { return Callee; }
+	llvm::ArrayRef<ExprAST*> getArgs() const { return Args; }
+	static bool classof(const ExprAST* E) { return E->getKind() == EK_Call; }
+};
+
+// represents the "prototype" of a function, which captures its
+// name, and its argument names (thus implicitly the number of
+// arguments the function takes).
+class PrototypeAST {
+	SymbolID Name;
+	std::vector<SymbolID> Args;
+	public:
+	PrototypeAST(SymbolID Name, std::vector<SymbolID> Args)
+		: Name(Name), Args(std::move(Args)) {
+		instrument::count(instrument::C_Prototypes);
+	}
+	SymbolID getName() const { return Name; }
+	llvm::ArrayRef<SymbolID> getArgs() const { return Args; }
+};
+
+// represents a function definition itself
+class FunctionAST {
+	std::unique_ptr<ASTArena> Arena;  // owns Body and everything under it
+	std::unique_ptr<PrototypeAST> Proto;
+	ExprAST* Body;
+	public:
+	FunctionAST(std::unique_ptr<ASTArena> Arena,
+			std::unique_ptr<PrototypeAST> Proto, ExprAST* Body)
+		: Arena(std::move(Arena)), Proto(std::move(Proto)), Body(Body) {
+		instrument::count(instrument::C_Functions);
+	}
+	const PrototypeAST& getProto() const { return *Proto; }
+	ExprAST* getBody() const { return Body; }
+
+	// for passes that rewrite the body: new nodes go in its arena
+	ASTArena& getArena() { return *Arena; }
+	void setBody(ExprAST* E) { Body = E; }
+};
+
+// a parsed top-level item
+struct TopLevelItem {
+	enum ItemKind {
+		TK_Definition,
+		TK_Extern,
+		TK_TopLevelExpr,
+		TK_Semicolon
+	};
+	ItemKind Kind;
+	// the parse, for a definition or a top-level expression
+	std::unique_ptr<FunctionAST> Function;
+	// the parse, for an extern
+	std::unique_ptr<PrototypeAST> Proto;
+	// set when the parse failed and error recovery had to skip the tok_eof
+	bool RecoveredAtEnd;
+
+	bool failed() const { return Kind != TK_Semicolon && !Function && !Proto; }
+};
+
+// ParseSummary -- how many items of each kind a parse produced, and how
+// many failed; what batch mode prints instead of a report per item
+struct ParseSummary {
+	unsigned Definitions = 0, Externs = 0, TopLevelExprs = 0, Errors = 0;
+
+	void add(TopLevelItem::ItemKind Kind) {
+		switch (Kind) {
+		case TopLevelItem::TK_Definition:
+			++Definitions;
+			break;
+		case TopLevelItem::TK_Extern:
+			++Externs;
+			break;
+		case TopLevelItem::TK_TopLevelExpr:
+			++TopLevelExprs;
+			break;
+		case TopLevelItem::TK_Semicolon:
+			break;
+		}
+	}
+	void add(const TopLevelItem& Item) {
+		if (Item.failed())
+			++Errors;
+		else
+			add(Item.Kind);
+	}
+	ParseSummary& operator+=(const ParseSummary& S) {
+		Definitions += S.Definitions;
+		Externs += S.Externs;
+		TopLevelExprs += S.TopLevelExprs;
+		Errors += S.Errors;
+		return *this;
+	}
+
+	void print(llvm::raw_ostream& OS) const {
+		OS << "definitions: " << Definitions << ", externs: " << Externs
+			<< ", top-level exprs: " << TopLevelExprs << ", errors: " << Errors
+			<< '\n';
+	}
+};
+
+// the number of nodes in E
+inline size_t countNodes(const ExprAST* E) {
+	size_t N = 0;
+	llvm::SmallVector<const ExprAST*, 32> Stack;
+	Stack.push_back(E);
+	while (!Stack.empty()) {
+		const ExprAST* Node = Stack.pop_back_val();
+		++N;
+		if (auto B = llvm::dyn_cast<BinaryExprAST>(Node)) {
+			Stack.push_back(B->getLHS());
+			Stack.push_back(B->getRHS());
+		}
+		else if (auto C = llvm::dyn_cast<CallExprAST>(Node))
+			Stack.append(C->getArgs().begin(), C->getArgs().end());
+	}
+	return N;
+}
+
+// ======   AST printing
+
+// print E as an s-expression, e.g. "(+ x (foo 1 2))". Uses an explicit
+// stack, so it copes with any tree the parser can build.
+inline void printExpr(llvm::raw_ostream& OS, const SymbolTable& Symbols,
+		const ExprAST* E) {
+	// each entry is a node and the index of its next child to print
+	llvm::SmallVector<std::pair<const ExprAST*, unsigned>, 32> Stack;
+	Stack.push_back(std::make_pair(E, 0u));
+	while (!Stack.empty()) {
+		const ExprAST* N = Stack.back().first;
+		unsigned Child = Stack.back().second++;
+		const ExprAST* Next = nullptr;
+		switch (N->getKind()) {
+		case ExprAST::EK_Number:
+			OS << llvm::format("%g", llvm::cast<NumberExprAST>(N)->getVal());
+			break;
+		case ExprAST::EK_Variable:
+			OS << Symbols.getName(llvm::cast<VariableExprAST>(N)->getName());
+			break;
+		case ExprAST::EK_Binary: {
+			auto B = llvm::cast<BinaryExprAST>(N);
+			if (Child == 0) {
+				OS << '(' << B->getOp() << ' ';
+				Next = B->getLHS();
+			}
+			else if (Child == 1) {
+				OS << ' ';
+				Next = B->getRHS();
+			}
+			else
+				OS << ')';
+			break;
+		}
+		case ExprAST::EK_Call: {
+			auto C = llvm::cast<CallExprAST>(N);
+			if (Child == 0)
+				OS << '(' << Symbols.getName(C->getCallee());
+			if (Child < C->getArgs().size()) {
+				OS << ' ';
+				Next = C->getArgs()[Child];
+			}
+			else
+				OS << ')';
+			break;
+		}
+		}
+		if (Next)
+			Stack.push_back(std::make_pair(Next, 0u));
+		else
+			Stack.pop_back();
+	}
+}
+
+inline void printProto(llvm::raw_ostream& OS, const SymbolTable& Symbols,
+		const PrototypeAST& Proto) {
+	OS << Symbols.getName(Proto.getName()) << " (";
+	for (unsigned I = 0, E = Proto.getArgs().size(); I != E; ++I)
+		OS << (I ? " " : "") << Symbols.getName(Proto.getArgs()[I]);
+	OS << ')';
+}
+
+// print a top-level item as -dump-ast does; a ';' or an item that failed
+// to parse prints nothing
+inline void printItem(llvm::raw_ostream& OS, const SymbolTable& Symbols,
+		const TopLevelItem& Item) {
+	if (Item.failed())
+		return;
+	switch (Item.Kind) {
+	case TopLevelItem::TK_Definition:
+		OS << "(def ";
+		printProto(OS, Symbols, Item.Function->getProto());
+		OS << ' ';
+		printExpr(OS, Symbols, Item.Function->getBody());
+		OS << ")\n";
+		break;
+	case TopLevelItem::TK_Extern:
+		OS << "(extern ";
+		printProto(OS, Symbols, *Item.Proto);
+		OS << ")\n";
+		break;
+	case TopLevelItem::TK_TopLevelExpr:
+		printExpr(OS, Symbols, Item.Function->getBody());
+		OS << '\n';
+		break;
+	case TopLevelItem::TK_Semicolon:
+		break;
+	}
+}
+
+#endif
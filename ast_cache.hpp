@@ -0,0 +1,225 @@
+#ifndef KALEIDOSCOPE_AST_CACHE_HPP
+#define KALEIDOSCOPE_AST_CACHE_HPP
+
+#include "flat_ast.hpp"
+#include "source_buffer.hpp"
+#include "symbol_table.hpp"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+
+// AST cache
+//
+// A cache file holds the complete parse of one source: its flat AST with
+// every top-level item, the names its SymbolIDs stand for, and the
+// messages the parse printed. It is named after a hash of the source's
+// bytes, so an edited source simply misses. The file is laid out as
+//
+//   CacheHeader, Constants, Nodes, Args, Protos, Items, Names, Transcript
+//
+// with each array in its in-memory form, so a hit maps the file and points
+// a FlatASTView at it without copying or converting anything. The names are
+// NUL-terminated strings in SymbolID order; loading interns them into an
+// empty SymbolTable, which hands them back the same IDs.
+//
+// The transcript also depends on the driver's options, e.g. batch mode
+// prints no prompts. Each cache has a variant, a string naming those
+// options, and caches with different variants keep their files apart:
+// ones with a variant are named <hash>-<variant hash>.ast.
+//
+// Cache files are native-endian, and are trusted: nothing but the header
+// is checked. They are written to a temporary name and renamed into
+// place, so a reader never sees a partial file.
+
+struct CacheHeader {
+	char Magic[8];
+	uint32_t Version;  // also catches a file of the other byte order
+	uint32_t NumSymbols;
+	uint64_t SourceHash;
+	uint64_t SourceSize;
+	uint32_t NumConstants, NumNodes, NumArgs, NumProtos, NumItems;
+	uint32_t NamesSize, TranscriptSize;
+	uint32_t VariantHash;  // see ASTCache
+	uint32_t NumFailed;  // the items that failed to parse
+	uint32_t Reserved;
+};
+static_assert(sizeof(CacheHeader) == 72, "CacheHeader should be 72 bytes");
+
+// CachedAST -- a cache file mapped back in
+class CachedAST {
+	std::unique_ptr<SourceBuffer> File;
+	FlatASTView AST;
+	llvm::StringRef Transcript;
+	unsigned NumFailed;
+
+	public:
+	CachedAST(std::unique_ptr<SourceBuffer> File, FlatASTView AST,
+			llvm::StringRef Transcript, unsigned NumFailed)
+		: File(std::move(File)), AST(AST), Transcript(Transcript),
+		NumFailed(NumFailed) {}
+
+	const FlatASTView& getAST() const { return AST; }
+	// everything the parse printed to stderr
+	llvm::StringRef getTranscript() const { return Transcript; }
+	// the items that failed to parse, which the AST leaves out
+	unsigned getNumFailed() const { return NumFailed; }
+};
+
+// ASTCache -- a directory of cache files
+class ASTCache {
+	static const uint32_t Version = 2;
+	static const char* magic() { return "KSASTC\0"; }  // with its NUL, 8 bytes
+
+	std::string Dir;
+	uint32_t VariantHash;
+
+	std::string getPath(uint64_t Hash) const {
+		llvm::SmallString<128> Path(Dir);
+		std::string Name;
+		llvm::raw_string_ostream OS(Name);
+		OS << llvm::format_hex_no_prefix(Hash, 16);
+		if (VariantHash)
+			OS << '-' << llvm::format_hex_no_prefix(VariantHash, 8);
+		OS << ".ast";
+		llvm::sys::path::append(Path, OS.str());
+		return Path.str().str();
+	}
+
+	template <typename T>
+	static void writeArray(llvm::raw_ostream& OS, llvm::ArrayRef<T> A) {
+		OS.write(reinterpret_cast<const char*>(A.data()), A.size() * sizeof(T));
+	}
+
+	// take the next N Ts from P
+	template <typename T>
+	static llvm::ArrayRef<T> readArray(const char*& P, uint32_t N) {
+		llvm::ArrayRef<T> A(reinterpret_cast<const T*>(P), N);
+		P += N * sizeof(T);
+		return A;
+	}
+
+	public:
+	// Variant names the options that the transcripts depend on
+	explicit ASTCache(llvm::StringRef Dir, llvm::StringRef Variant = "")
+		: Dir(Dir),
+		VariantHash(Variant.empty() ? 0 : uint32_t(llvm::xxHash64(Variant))) {}
+
+	static uint64_t hashSource(llvm::StringRef Source) {
+		return llvm::xxHash64(Source);
+	}
+
+	// the cached parse of Source, or nullptr. Symbols must be a fresh
+	// table; on a hit it holds the names the cached AST refers to. (A miss
+	// may leave some names interned, which is harmless.)
+	std::unique_ptr<CachedAST> lookup(llvm::StringRef Source,
+			SymbolTable& Symbols) const {
+		uint64_t Hash = hashSource(Source);
+		std::unique_ptr<SourceBuffer> File =
+			SourceBuffer::openFile(getPath(Hash).c_str());
+		if (!File || File->size() < sizeof(CacheHeader))
+			return nullptr;
+
+		CacheHeader H;
+		memcpy(&H, File->begin(), sizeof(H));
+		if (memcmp(H.Magic, magic(), sizeof(H.Magic)) || H.Version != Version ||
+				H.SourceHash != Hash || H.SourceSize != Source.size() ||
+				H.VariantHash != VariantHash)
+			return nullptr;
+		uint64_t Size = sizeof(H) + uint64_t(H.NumConstants) * sizeof(double)
+			+ uint64_t(H.NumNodes) * sizeof(FlatExpr)
+			+ (uint64_t(H.NumArgs) + H.NumProtos) * sizeof(uint32_t)
+			+ uint64_t(H.NumItems) * sizeof(FlatItem)
+			+ H.NamesSize + H.TranscriptSize;
+		if (Size != File->size())
+			return nullptr;
+
+		const char* P = File->begin() + sizeof(H);
+		auto Constants = readArray<double>(P, H.NumConstants);
+		auto Nodes = readArray<FlatExpr>(P, H.NumNodes);
+		auto Args = readArray<uint32_t>(P, H.NumArgs);
+		auto Protos = readArray<uint32_t>(P, H.NumProtos);
+		auto Items = readArray<FlatItem>(P, H.NumItems);
+
+		const char* NamesEnd = P + H.NamesSize;
+		for (SymbolID ID = 0; ID != H.NumSymbols; ++ID) {
+			size_t Len = strnlen(P, NamesEnd - P);
+			if (P + Len == NamesEnd ||
+					Symbols.intern(llvm::StringRef(P, Len)) != ID)
+				return nullptr;
+			P += Len + 1;
+		}
+		llvm::StringRef Transcript(NamesEnd, H.TranscriptSize);
+
+		FlatASTView AST(Nodes, Args, Constants, Protos, Items);
+		return std::unique_ptr<CachedAST>(
+			new CachedAST(std::move(File), AST, Transcript, H.NumFailed));
+	}
+
+	// save the parse of Source, in which NumFailed items failed; returns
+	// false if it could not be written
+	bool store(llvm::StringRef Source, const SymbolTable& Symbols,
+			const FlatASTView& AST, llvm::StringRef Transcript,
+			unsigned NumFailed) const {
+		if (llvm::sys::fs::create_directories(Dir))
+			return false;
+		llvm::SmallString<128> Model(Dir), TmpPath;
+		llvm::sys::path::append(Model, "ast-%%%%%%%%.tmp");
+		int FD;
+		if (llvm::sys::fs::createUniqueFile(Model, FD, TmpPath))
+			return false;
+
+		std::string Names;
+		for (SymbolID ID = 0; ID != Symbols.size(); ++ID) {
+			Names += Symbols.getName(ID);
+			Names += '\0';
+		}
+
+		CacheHeader H;
+		memset(&H, 0, sizeof(H));
+		memcpy(H.Magic, magic(), sizeof(H.Magic));
+		H.Version = Version;
+		H.NumSymbols = Symbols.size();
+		H.SourceHash = hashSource(Source);
+		H.SourceSize = Source.size();
+		H.NumConstants = AST.constants().size();
+		H.NumNodes = AST.nodes().size();
+		H.NumArgs = AST.args().size();
+		H.NumProtos = AST.protos().size();
+		H.NumItems = AST.items().size();
+		H.NamesSize = Names.size();
+		H.TranscriptSize = Transcript.size();
+		H.VariantHash = VariantHash;
+		H.NumFailed = NumFailed;
+
+		bool Failed;
+		{
+			llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+			OS.write(reinterpret_cast<const char*>(&H), sizeof(H));
+			writeArray(OS, AST.constants());
+			writeArray(OS, AST.nodes());
+			writeArray(OS, AST.args());
+			writeArray(OS, AST.protos());
+			writeArray(OS, AST.items());
+			OS << Names << Transcript;
+			OS.close();
+			Failed = OS.has_error();
+			OS.clear_error();
+		}
+		if (Failed || llvm::sys::fs::rename(TmpPath, getPath(H.SourceHash))) {
+			llvm::sys::fs::remove(TmpPath);
+			return false;
+		}
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef KALEIDOSCOPE_BATCH_EXECUTOR_HPP
+#define KALEIDOSCOPE_BATCH_EXECUTOR_HPP
+
+#include "instrument.hpp"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Batch execution
+
+// BatchExecutor -- runs a batch kernel (see CodeGen::emitBatch()) over N
+// rows on several threads: the calling one, and workers that live as long
+// as the executor. The rows are cut into chunks, and each thread starts
+// with a contiguous run of them, which it works through from the front. A
+// thread that runs out steals the back half of the run of whichever thread
+// has the most left, so each thread mostly writes one contiguous part of
+// the output, and the rest goes to the threads that are free.
+//
+// A batch of no more than two chunks runs on the calling thread alone, as
+// waking the workers would cost more than it saves.
+//
+// Nothing is allocated per run: the output is the caller's, allocated once
+// and reused. On a NUMA machine, where a page goes to the node of the
+// thread that first writes it, place() first writes an output, or an input
+// column, the way run() will go over it, without the stealing, so that
+// each thread's part of it is on its own node (as long as the OS keeps the
+// threads where they are; they are not pinned). That only works on memory
+// nothing has written yet.
+class BatchExecutor {
+	public:
+	using Kernel = void (*)(const double* const* Args, double* Out, size_t N);
+
+	private:
+	// the chunks a thread has yet to run, [Begin, End)
+	struct ChunkRun {
+		std::mutex Lock;
+		size_t Begin = 0, End = 0;
+	};
+
+	size_t ChunkRows;
+	unsigned NumThreads;
+	std::unique_ptr<ChunkRun[]> Runs;  // one per thread, the caller's first
+	std::vector<std::thread> Workers;
+
+	std::mutex Lock;
+	std::condition_variable Wake, Finished;
+	uint64_t Job = 0;  // bumped for each run, to wake the workers for it
+	unsigned Busy = 0;  // the workers that have yet to finish the run
+	bool Stopping = false;
+
+	// the run: Kern over Columns and Out, or nullptr to zero Out
+	Kernel Kern = nullptr;
+	llvm::ArrayRef<const double*> Columns;
+	double* Out = nullptr;
+	size_t NumRows = 0;
+	bool Stealing = true;
+
+	void runChunk(size_t Chunk) {
+		size_t Begin = Chunk * ChunkRows;
+		size_t Rows = std::min(ChunkRows, NumRows - Begin);
+		instrument::count(instrument::C_BatchChunks);
+		if (!Kern) {
+			std::fill(Out + Begin, Out + Begin + Rows, 0.0);
+			return;
+		}
+		llvm::SmallVector<const double*, 8> Args;
+		for (const double* Column : Columns)
+			Args.push_back(Column + Begin);
+		Kern(Args.data(), Out + Begin, Rows);
+	}
+
+	// take the back half of the longest run of another thread's but Self's,
+	// into Self's own, which is empty; false if there is none left
+	bool steal(unsigned Self) {
+		while (true) {
+			unsigned Victim = Self;
+			size_t Most = 0;
+			for (unsigned T = 0; T != NumThreads; ++T) {
+				if (T == Self)
+					continue;
+				std::lock_guard<std::mutex> L(Runs[T].Lock);
+				if (Runs[T].End - Runs[T].Begin > Most) {
+					Most = Runs[T].End - Runs[T].Begin;
+					Victim = T;
+				}
+			}
+			if (Victim == Self)
+				return false;
+			size_t Begin, End;
+			{
+				ChunkRun& V = Runs[Victim];
+				std::lock_guard<std::mutex> L(V.Lock);
+				if (V.Begin == V.End)
+					continue;  // another thief got there first
+				End = V.End;
+				Begin = V.End -= (V.End - V.Begin + 1) / 2;
+			}
+			instrument::count(instrument::C_BatchSteals);
+			std::lock_guard<std::mutex> L(Runs[Self].Lock);
+			Runs[Self].Begin = Begin;
+			Runs[Self].End = End;
+			return true;
+		}
+	}
+
+	// Self's next chunk, stolen if need be; false when there are none left
+	bool next(unsigned Self, size_t& Chunk) {
+		do {
+			std::lock_guard<std::mutex> L(Runs[Self].Lock);
+			if (Runs[Self].Begin != Runs[Self].End) {
+				Chunk = Runs[Self].Begin++;
+				return true;
+			}
+		} while (Stealing && steal(Self));
+		return false;
+	}
+
+	void work(unsigned Self) {
+		size_t Chunk;
+		while (next(Self, Chunk))
+			runChunk(Chunk);
+	}
+
+	void workerMain(unsigned Self) {
+		uint64_t Done = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> L(Lock);
+				Wake.wait(L, [&] { return Stopping || Job != Done; });
+				if (Stopping)
+					return;
+				Done = Job;
+			}
+			work(Self);
+			std::lock_guard<std::mutex> L(Lock);
+			if (--Busy == 0)
+				Finished.notify_all();
+		}
+	}
+
+	// run the job set up in the members on every thread, and wait for it
+	void dispatch() {
+		size_t NumChunks = (NumRows + ChunkRows - 1) / ChunkRows;
+		for (unsigned T = 0; T != NumThreads; ++T) {
+			std::lock_guard<std::mutex> L(Runs[T].Lock);
+			Runs[T].Begin = NumChunks * T / NumThreads;
+			Runs[T].End = NumChunks * (T + 1) / NumThreads;
+		}
+		{
+			std::lock_guard<std::mutex> L(Lock);
+			++Job;
+			Busy = Workers.size();
+		}
+		Wake.notify_all();
+		work(0);
+		// the workers may still be reading the job, even with no chunks left
+		std::unique_lock<std::mutex> L(Lock);
+		Finished.wait(L, [&] { return Busy == 0; });
+	}
+
+	public:
+	// an executor on Threads threads, the caller's among them, or one per
+	// core if 0, running ChunkRows rows at a time
+	explicit BatchExecutor(unsigned Threads = 0, size_t ChunkRows = 16384)
+		: ChunkRows(std::max<size_t>(ChunkRows, 1)),
+			NumThreads(Threads ? Threads
+				: std::max(std::thread::hardware_concurrency(), 1u)),
+			Runs(new ChunkRun[NumThreads]) {
+		for (unsigned T = 1; T != NumThreads; ++T)
+			Workers.emplace_back([this, T] { workerMain(T); });
+	}
+
+	~BatchExecutor() {
+		{
+			std::lock_guard<std::mutex> L(Lock);
+			Stopping = true;
+		}
+		Wake.notify_all();
+		for (std::thread& W : Workers)
+			W.join();
+	}
+
+	BatchExecutor(const BatchExecutor&) = delete;
+	BatchExecutor& operator=(const BatchExecutor&) = delete;
+
+	unsigned getNumThreads() const { return NumThreads; }
+
+	// K(Args, Out, N), from the calling thread and the workers at once. Not
+	// to be called from two threads at once.
+	void run(Kernel K, llvm::ArrayRef<const double*> Args, double* Out,
+			size_t N) {
+		if (N <= 2 * ChunkRows || NumThreads == 1) {
+			K(Args.data(), Out, N);
+			return;
+		}
+		Kern = K;
+		Columns = Args;
+		this->Out = Out;
+		NumRows = N;
+		Stealing = true;
+		dispatch();
+	}
+
+	// zero Out, of N rows, from the threads that will write each part of it
+	// in a run() of N rows
+	void place(double* Out, size_t N) {
+		if (N <= 2 * ChunkRows || NumThreads == 1) {
+			std::fill(Out, Out + N, 0.0);
+			return;
+		}
+		Kern = nullptr;
+		this->Out = Out;
+		NumRows = N;
+		Stealing = false;
+		dispatch();
+	}
+};
+
+#endif
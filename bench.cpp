@@ -0,0 +1,213 @@
+#include "ast.hpp"
+#include "diagnostics.hpp"
+#include "lexer.hpp"
+#include "memory_usage.hpp"
+#include "parser.hpp"
+#include "source_buffer.hpp"
+#include "symbol_table.hpp"
+#include "workloads.hpp"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Front-end benchmarks
+//
+// Generates each synthetic workload and measures, on it, gettok() over
+// the whole source and the Parse* entry point its items go through. Each
+// measurement is the best of -repeat runs. Parsing runs over a token
+// buffer lexed beforehand, so its figures are for the parser alone.
+
+static llvm::cl::opt<unsigned> SizeMB("size",
+	llvm::cl::desc("Generate this many megabytes of each workload"),
+	llvm::cl::init(4));
+
+static llvm::cl::opt<unsigned> Repeat("repeat",
+	llvm::cl::desc("Report the best of this many runs"), llvm::cl::init(3));
+
+static llvm::cl::opt<unsigned> Seed("seed",
+	llvm::cl::desc("Seed for the workload generators"), llvm::cl::init(1));
+
+static llvm::cl::opt<bool> IterativeParse("iterative",
+	llvm::cl::desc("Parse expressions without recursion"));
+
+static llvm::cl::list<std::string> Only("workload",
+	llvm::cl::desc("Run only these workloads"), llvm::cl::CommaSeparated);
+
+enum EntryPoint { EP_Definition, EP_Extern, EP_TopLevelExpr };
+
+static const char* getEntryPointName(EntryPoint E) {
+	switch (E) {
+	case EP_Definition:
+		return "ParseDefinition";
+	case EP_Extern:
+		return "ParseExtern";
+	case EP_TopLevelExpr:
+		return "ParseTopLevelExpr";
+	}
+	return "";
+}
+
+struct Workload {
+	const char* Name;
+	void (*Generate)(std::string& Out, size_t Size, uint64_t Seed);
+	EntryPoint Entry;  // what every item in it is parsed by
+};
+
+static const Workload Workloads[] = {
+	{"chains", [](std::string& Out, size_t Size, uint64_t Seed) {
+		genOperatorChains(Out, Size, Seed);
+	}, EP_TopLevelExpr},
+	{"parens", [](std::string& Out, size_t Size, uint64_t Seed) {
+		genDeepParens(Out, Size, Seed);
+	}, EP_TopLevelExpr},
+	{"calls", [](std::string& Out, size_t Size, uint64_t Seed) {
+		genWideCalls(Out, Size, Seed);
+	}, EP_TopLevelExpr},
+	{"defs", genManyDefs, EP_Definition},
+	{"externs", genManyExterns, EP_Extern},
+	{"tables", [](std::string& Out, size_t Size, uint64_t Seed) {
+		genNumericTables(Out, Size, Seed);
+	}, EP_TopLevelExpr},
+};
+
+static double now() {
+	return std::chrono::duration<double>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void configure(Parser& P) {
+	P.setBinopPrecedence('<', 10);
+	P.setBinopPrecedence('+', 20);
+	P.setBinopPrecedence('-', 20);
+	P.setBinopPrecedence('*', 40);
+	P.setIterative(IterativeParse);
+}
+
+// one pass of Entry over every item in Tokens; returns the number of AST
+// nodes built, counting a prototype as a node, or 0 if CountNodes is false
+static size_t parseAll(const TokenBuffer& Tokens, EntryPoint Entry,
+		DiagnosticEngine& Diags, bool CountNodes) {
+	Parser P(Tokens, 0, Tokens.size(), Diags);
+	configure(P);
+	size_t Nodes = 0;
+	P.getNextToken();
+	while (P.getCurTok() != tok_eof) {
+		if (P.getCurTok() == ';') {
+			P.getNextToken();
+			continue;
+		}
+		std::unique_ptr<FunctionAST> F;
+		std::unique_ptr<PrototypeAST> Proto;
+		switch (Entry) {
+		case EP_Definition:
+			F = P.ParseDefinition();
+			break;
+		case EP_Extern:
+			Proto = P.ParseExtern();
+			break;
+		case EP_TopLevelExpr:
+			F = P.ParseTopLevelExpr();
+			break;
+		}
+		if (!F && !Proto) {
+			P.getNextToken();
+			continue;
+		}
+		if (CountNodes)
+			Nodes += 1 + (F ? countNodes(F->getBody()) : 0);
+	}
+	return Nodes;
+}
+
+struct Result {
+	double Seconds;
+	size_t PeakRSS;
+};
+
+template <typename Fn>
+static Result measure(Fn Run) {
+	Result Best{0, 0};
+	for (unsigned I = 0; I != std::max(1u, unsigned(Repeat)); ++I) {
+		resetPeakRSS();
+		double Start = now();
+		Run();
+		double Seconds = now() - Start;
+		size_t Peak = getPeakRSS();
+		if (!I || Seconds < Best.Seconds)
+			Best.Seconds = Seconds;
+		Best.PeakRSS = std::max(Best.PeakRSS, Peak);
+	}
+	return Best;
+}
+
+static void report(const char* Workload, const char* Stage, size_t Bytes,
+		size_t Tokens, size_t Nodes, const Result& R) {
+	double S = R.Seconds > 0 ? R.Seconds : 1e-9;
+	llvm::outs() << llvm::format("%-8s %-18s %9.1f %9.2f ", Workload, Stage,
+		Bytes / S / 1e6, Tokens / S / 1e6);
+	if (Nodes)
+		llvm::outs() << llvm::format("%9.2f", Nodes / S / 1e6);
+	else
+		llvm::outs() << "        -";
+	llvm::outs() << llvm::format(" %9.1f\n", R.PeakRSS / 1048576.0);
+}
+
+static void run(const Workload& W) {
+	std::string Text;
+	W.Generate(Text, size_t(SizeMB) << 20, Seed);
+
+	// gettok()
+	size_t NumTokens = 0;
+	Result Lexing = measure([&] {
+		SymbolTable Symbols;
+		std::unique_ptr<SourceBuffer> Source =
+			SourceBuffer::fromString(Text.data(), Text.size());
+		DiagnosticEngine Diags(llvm::errs(), Source.get());
+		Lexer Lex(*Source, Symbols, Diags);
+		NumTokens = 0;
+		while (Lex.gettok() != tok_eof)
+			++NumTokens;
+	});
+	report(W.Name, "gettok", Text.size(), NumTokens, 0, Lexing);
+
+	// the Parse* entry point
+	SymbolTable Symbols;
+	std::unique_ptr<SourceBuffer> Source =
+		SourceBuffer::fromString(Text.data(), Text.size());
+	TokenBuffer Tokens;
+	DiagnosticEngine Diags(llvm::errs(), Source.get());
+	Diags.setMaxErrors(5);
+	Lexer(*Source, Symbols, Diags).lexAll(Tokens);
+
+	size_t NumNodes = parseAll(Tokens, W.Entry, Diags, true);
+	if (Diags.getNumErrors())
+		llvm::errs() << W.Name << ": the workload did not parse cleanly\n";
+	Result Parsing = measure([&] {
+		DiagnosticEngine Quiet(llvm::nulls());
+		parseAll(Tokens, W.Entry, Quiet, false);
+	});
+	report(W.Name, getEntryPointName(W.Entry), Text.size(), Tokens.size() - 1,
+		NumNodes, Parsing);
+}
+
+int main(int argc, char** argv) {
+	llvm::cl::ParseCommandLineOptions(argc, argv,
+		"Kaleidoscope front-end benchmarks\n");
+
+	llvm::outs() << "workload stage                   MB/s    Mtok/s  Mnodes/s"
+		"   peak MB\n";
+	for (const Workload& W : Workloads) {
+		if (!Only.empty() &&
+				std::find(Only.begin(), Only.end(), W.Name) == Only.end())
+			continue;
+		run(W);
+		llvm::outs().flush();
+	}
+	return 0;
+}
@@ -0,0 +1,544 @@
+#ifndef KALEIDOSCOPE_CODEGEN_HPP
+#define KALEIDOSCOPE_CODEGEN_HPP
+
+#include "ast.hpp"
+#include "diagnostics.hpp"
+#include "extern_table.hpp"
+#include "instrument.hpp"
+#include "symbol_table.hpp"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/Attributes.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Type.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/ErrorHandling.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Code generation
+
+// CalleeBinding -- what the calls to a function are bound to: a function
+// of the program's, a host function, an intrinsic, or else an extern that
+// the JIT looks up by name
+struct CalleeBinding {
+	enum BindingKind : uint8_t { CB_Extern, CB_Defined, CB_Host, CB_Intrinsic };
+	BindingKind Kind;
+	// the intrinsic, for CB_Intrinsic
+	llvm::Intrinsic::ID Intrinsic;
+};
+
+// FunctionTable -- what every module knows of the functions of the others
+struct FunctionTable {
+	// the number of arguments of every function declared so far, anywhere
+	llvm::DenseMap<SymbolID, unsigned> Arity;
+	// every function defined so far, anywhere
+	llvm::DenseSet<SymbolID> Defined;
+	// the binding of every function declared so far, recorded when it is
+	// declared or defined. An extern bound to an intrinsic may not be
+	// defined later, so the calls to it are generated alike, whenever that
+	// is.
+	llvm::DenseMap<SymbolID, CalleeBinding> Bindings;
+	// the definitions to import into the modules that call them
+	llvm::DenseMap<SymbolID, std::shared_ptr<const FunctionAST>> Inlinable;
+};
+
+// CodeGen -- lowers top-level items to LLVM IR, one function each, in the
+// current module. takeModule() hands the module over, e.g. to the JIT, and
+// starts a new one, each with a context of its own.
+//
+// Functions outlive the module they are in: a call to a function that an
+// earlier item defined or declared declares it again in the current
+// module, and a definition may not repeat an earlier one.
+//
+// A definition is checked, by define(), when it is read, and generated, by
+// emit(), whenever it is needed: codegen() does both at once. Errors are all
+// found by the check, so the IR can be generated later, e.g. only once the
+// function is first called.
+//
+// For the inliner, the definitions given to addInlinable() are generated
+// again in every later module that calls them, as available_externally
+// copies: there for the optimizer to see, but never compiled, as the JIT
+// already has them.
+//
+// Several CodeGens may share a FunctionTable, each generating modules on a
+// thread of its own, provided none of them is changing the table (with
+// codegen(), define() or addInlinable()) at the time: emit() only reads it.
+//
+// A call to an extern that an ExternTable binds to an intrinsic calls the
+// intrinsic (see extern_table.hpp), and the extern may not then be
+// defined. Every other call is marked nobuiltin,
+// so that the optimizer never takes a function for the C library function
+// of the same name.
+//
+// The AST carries no locations, so errors are reported at the offset given
+// to setLocation(): the start of the item being generated.
+class CodeGen {
+	const SymbolTable& Symbols;
+	DiagnosticEngine& Diags;
+	llvm::DataLayout Layout;
+	const ExternTable* Externs;
+	uint32_t Location = 0;
+
+	std::unique_ptr<llvm::LLVMContext> Context;
+	std::unique_ptr<llvm::Module> M;
+	std::unique_ptr<llvm::IRBuilder<>> Builder;
+
+	// the functions declared in the current module
+	llvm::DenseMap<SymbolID, llvm::Function*> Functions;
+	// shared with the other CodeGens, if any
+	FunctionTable& Table;
+	// the arguments of the function being generated, indexed by SymbolID
+	std::vector<llvm::Value*> NamedValues;
+	// the functions the current module has yet to import, and has imported
+	llvm::SmallVector<SymbolID, 8> Imports;
+	std::vector<const FunctionAST*> Imported;
+
+	void startModule() {
+		Context = std::make_unique<llvm::LLVMContext>();
+		M = std::make_unique<llvm::Module>("kaleidoscope", *Context);
+		M->setDataLayout(Layout);
+		Builder = std::make_unique<llvm::IRBuilder<>>(*Context);
+		Functions.clear();
+		Imports.clear();
+		Imported.clear();
+	}
+
+	std::nullptr_t LogError(DiagID ID) {
+		Diags.report(ID, Location);
+		return nullptr;
+	}
+	bool fail(DiagID ID) {
+		LogError(ID);
+		return false;
+	}
+
+	// double Name(double, ...), declared in the current module
+	llvm::Function* declare(SymbolID Name, unsigned NumArgs) {
+		llvm::Type* Double = llvm::Type::getDoubleTy(*Context);
+		std::vector<llvm::Type*> Doubles(NumArgs, Double);
+		llvm::FunctionType* FT = llvm::FunctionType::get(Double, Doubles, false);
+		llvm::Function* F = llvm::Function::Create(FT,
+			llvm::Function::ExternalLinkage, Symbols.getName(Name), M.get());
+		Functions[Name] = F;
+		return F;
+	}
+
+	// Name in the current module, declared there if an earlier item
+	// declared it; nullptr if none has
+	llvm::Function* getFunction(SymbolID Name) {
+		auto I = Functions.find(Name);
+		if (I != Functions.end())
+			return I->second;
+		auto A = Table.Arity.find(Name);
+		if (A == Table.Arity.end())
+			return nullptr;
+		if (Table.Inlinable.count(Name))
+			Imports.push_back(Name);
+		return declare(Name, A->second);
+	}
+
+	// the binding of an extern Name of NumArgs arguments: the intrinsic the
+	// ExternTable binds it to, if any, with that many arguments
+	CalleeBinding bindExtern(SymbolID Name, unsigned NumArgs) const {
+		const ExternTable::Binding* B = Externs
+			? Externs->lookup(Symbols.getName(Name)) : nullptr;
+		if (!B || B->Intrinsic == llvm::Intrinsic::not_intrinsic ||
+				B->NumArgs != NumArgs)
+			return CalleeBinding{CalleeBinding::CB_Extern,
+				llvm::Intrinsic::not_intrinsic};
+		return CalleeBinding{CalleeBinding::CB_Intrinsic, B->Intrinsic};
+	}
+
+	// the intrinsic the calls to Name are bound to, declared in the current
+	// module, or nullptr if they are bound to none
+	llvm::Function* getIntrinsic(SymbolID Name) {
+		auto B = Table.Bindings.find(Name);
+		if (B == Table.Bindings.end() ||
+				B->second.Kind != CalleeBinding::CB_Intrinsic)
+			return nullptr;
+		return llvm::Intrinsic::getDeclaration(M.get(), B->second.Intrinsic,
+			llvm::Type::getDoubleTy(*Context));
+	}
+
+	// call F, a function of the program's or an extern called by name, as
+	// nobuiltin
+	llvm::CallInst* createCall(llvm::Function* F,
+			llvm::ArrayRef<llvm::Value*> Args) {
+		llvm::CallInst* Call = Builder->CreateCall(F, Args, "calltmp");
+		Call->addFnAttr(llvm::Attribute::NoBuiltin);
+		return Call;
+	}
+
+	// generate Fn's body into F, which has none yet
+	void emitBody(llvm::Function* F, const FunctionAST& Fn) {
+		const PrototypeAST& Proto = Fn.getProto();
+		// create a new basic block to start insertion into
+		Builder->SetInsertPoint(llvm::BasicBlock::Create(*Context, "entry", F));
+		// record the function arguments in the NamedValues table
+		if (NamedValues.size() < Symbols.size())
+			NamedValues.resize(Symbols.size());
+		unsigned I = 0;
+		for (llvm::Argument& Arg : F->args())
+			NamedValues[Proto.getArgs()[I++]] = &Arg;
+		Builder->CreateRet(codegen(Fn.getBody()));
+		for (SymbolID Arg : Proto.getArgs())
+			NamedValues[Arg] = nullptr;
+	}
+
+	// give the functions the current module calls their imported bodies,
+	// and those bodies theirs
+	void importInlinable() {
+		while (!Imports.empty()) {
+			SymbolID Name = Imports.pop_back_val();
+			llvm::Function* F = Functions[Name];
+			const FunctionAST& Fn = *Table.Inlinable.find(Name)->second;
+			emitBody(F, Fn);
+			F->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+			Imported.push_back(&Fn);
+		}
+	}
+
+	void nameArgs(llvm::Function* F, llvm::ArrayRef<SymbolID> Args) {
+		unsigned I = 0;
+		for (llvm::Argument& Arg : F->args())
+			Arg.setName(Symbols.getName(Args[I++]));
+	}
+
+	// whether E only uses the arguments Args, the binary operators there are
+	// instructions for, and functions declared so far, each with the right
+	// number of arguments; reports the first error if not
+	bool check(const ExprAST* E, llvm::ArrayRef<SymbolID> Args) {
+		llvm::SmallVector<const ExprAST*, 32> Stack;
+		Stack.push_back(E);
+		while (!Stack.empty()) {
+			const ExprAST* N = Stack.pop_back_val();
+			switch (N->getKind()) {
+			case ExprAST::EK_Number:
+				break;
+			case ExprAST::EK_Variable:
+				if (!llvm::is_contained(Args,
+						llvm::cast<VariableExprAST>(N)->getName()))
+					return fail(err_unknown_variable);
+				break;
+			case ExprAST::EK_Binary: {
+				auto B = llvm::cast<BinaryExprAST>(N);
+				if (!llvm::StringRef("+-*<").contains(B->getOp()))
+					return fail(err_invalid_binary_operator);
+				Stack.push_back(B->getRHS());
+				Stack.push_back(B->getLHS());
+				break;
+			}
+			case ExprAST::EK_Call: {
+				auto C = llvm::cast<CallExprAST>(N);
+				auto A = Table.Arity.find(C->getCallee());
+				if (A == Table.Arity.end())
+					return fail(err_unknown_function);
+				if (A->second != C->getArgs().size())
+					return fail(err_wrong_arg_count);
+				for (size_t I = C->getArgs().size(); I--;)
+					Stack.push_back(C->getArgs()[I]);
+				break;
+			}
+			}
+		}
+		return true;
+	}
+
+	llvm::Value* emitBinary(char Op, llvm::Value* L, llvm::Value* R) {
+		switch (Op) {
+		case '+':
+			return Builder->CreateFAdd(L, R, "addtmp");
+		case '-':
+			return Builder->CreateFSub(L, R, "subtmp");
+		case '*':
+			return Builder->CreateFMul(L, R, "multmp");
+		case '<':
+			L = Builder->CreateFCmpULT(L, R, "cmptmp");
+			// convert bool 0/1 to double 0.0 or 1.0
+			return Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*Context),
+				"booltmp");
+		default:
+			llvm_unreachable("operator not checked");
+		}
+	}
+
+	public:
+	// Layout is the target's, e.g. the JIT's; Externs may be nullptr, to
+	// call every extern by name
+	CodeGen(const SymbolTable& Symbols, DiagnosticEngine& Diags,
+			FunctionTable& Table, const llvm::DataLayout& Layout,
+			const ExternTable* Externs = nullptr)
+		: Symbols(Symbols), Diags(Diags), Layout(Layout), Externs(Externs),
+			Table(Table) {
+		startModule();
+	}
+
+	// where errors in the next items are reported
+	void setLocation(uint32_t Offset) { Location = Offset; }
+
+	// record the host function Name, of NumArgs arguments, as defined, so
+	// that items may call it without an extern, and may not define it
+	void defineHostFunction(SymbolID Name, unsigned NumArgs) {
+		Table.Arity[Name] = NumArgs;
+		Table.Defined.insert(Name);
+		Table.Bindings[Name] = CalleeBinding{CalleeBinding::CB_Host,
+			llvm::Intrinsic::not_intrinsic};
+	}
+
+	// import Fn, which has been defined, into the later modules that call it
+	void addInlinable(std::shared_ptr<const FunctionAST> Fn) {
+		SymbolID Name = Fn->getProto().getName();
+		Table.Inlinable[Name] = std::move(Fn);
+	}
+
+	FunctionTable& getFunctionTable() const { return Table; }
+	llvm::Module& getModule() const { return *M; }
+	// the definitions imported into the current module, in order
+	llvm::ArrayRef<const FunctionAST*> getImported() const { return Imported; }
+
+	// the current module, with everything generated since the last call;
+	// later items go into a new one
+	llvm::orc::ThreadSafeModule takeModule() {
+		llvm::orc::ThreadSafeModule TSM(std::move(M), std::move(Context));
+		startModule();
+		return TSM;
+	}
+
+	// E's value, emitted at the builder's insertion point; E must have been
+	// checked. Uses an explicit stack, like printExpr(), so it copes with any
+	// tree the parser can build. An operator node that is shared, as the
+	// Simplifier shares them, is generated once, on its first use.
+	llvm::Value* codegen(const ExprAST* E) {
+		// each entry is a node and the index of its next operand to generate;
+		// the operands generated so far are on Values
+		llvm::SmallVector<std::pair<const ExprAST*, unsigned>, 32> Stack;
+		llvm::SmallVector<llvm::Value*, 32> Values;
+		llvm::DenseMap<const ExprAST*, llvm::Value*> Generated;
+		Stack.push_back(std::make_pair(E, 0u));
+		while (!Stack.empty()) {
+			const ExprAST* N = Stack.back().first;
+			unsigned Child = Stack.back().second++;
+			const ExprAST* Next = nullptr;
+			llvm::Value* V = nullptr;
+			switch (N->getKind()) {
+			case ExprAST::EK_Number:
+				V = llvm::ConstantFP::get(*Context,
+					llvm::APFloat(llvm::cast<NumberExprAST>(N)->getVal()));
+				break;
+			case ExprAST::EK_Variable:
+				V = NamedValues[llvm::cast<VariableExprAST>(N)->getName()];
+				break;
+			case ExprAST::EK_Binary: {
+				auto B = llvm::cast<BinaryExprAST>(N);
+				if (Child == 0) {
+					// the body has no branches, so an earlier value is in scope
+					auto G = Generated.find(B);
+					if (G != Generated.end())
+						V = G->second;
+					else
+						Next = B->getLHS();
+				}
+				else if (Child == 1)
+					Next = B->getRHS();
+				else {
+					llvm::Value* R = Values.pop_back_val();
+					llvm::Value* L = Values.pop_back_val();
+					V = emitBinary(B->getOp(), L, R);
+					Generated[B] = V;
+				}
+				break;
+			}
+			case ExprAST::EK_Call: {
+				auto C = llvm::cast<CallExprAST>(N);
+				llvm::ArrayRef<ExprAST*> Args = C->getArgs();
+				if (Child < Args.size())
+					Next = Args[Child];
+				else {
+					// look up the name in the global module table
+					SymbolID Callee = C->getCallee();
+					llvm::ArrayRef<llvm::Value*> Operands =
+						llvm::makeArrayRef(Values).take_back(Args.size());
+					if (llvm::Function* F = getIntrinsic(Callee))
+						V = Builder->CreateCall(F, Operands, "calltmp");
+					else
+						V = createCall(getFunction(Callee), Operands);
+					Values.truncate(Values.size() - Args.size());
+				}
+				break;
+			}
+			}
+			if (Next)
+				Stack.push_back(std::make_pair(Next, 0u));
+			else {
+				Stack.pop_back();
+				Values.push_back(V);
+			}
+		}
+		return Values.back();
+	}
+
+	// declare Proto's function in the current module
+	llvm::Function* codegen(const PrototypeAST& Proto) {
+		instrument::ScopedTimer Timer(instrument::T_Codegen);
+		SymbolID Name = Proto.getName();
+		auto R = Table.Arity.insert(std::make_pair(Name,
+			unsigned(Proto.getArgs().size())));
+		if (!R.second && R.first->second != Proto.getArgs().size())
+			return LogError(err_function_redeclared);
+		if (R.second)
+			Table.Bindings[Name] = bindExtern(Name, Proto.getArgs().size());
+		llvm::Function* F = getFunction(Name);
+		nameArgs(F, Proto.getArgs());
+		return F;
+	}
+
+	// check Fn, and record its function as defined from now on, so that
+	// later items may call it; false after an error
+	bool define(const FunctionAST& Fn) {
+		instrument::ScopedTimer Timer(instrument::T_Codegen);
+		const PrototypeAST& Proto = Fn.getProto();
+		SymbolID Name = Proto.getName();
+		// every top-level expression is a new __anon_expr, called by no one
+		if (Name == sym_anon_expr)
+			return check(Fn.getBody(), Proto.getArgs());
+		if (Table.Defined.count(Name))
+			return fail(err_function_redefined);
+		auto R = Table.Arity.insert(std::make_pair(Name,
+			unsigned(Proto.getArgs().size())));
+		if (!R.second && R.first->second != Proto.getArgs().size())
+			return fail(err_function_redeclared);
+		if (!R.second &&
+				Table.Bindings.lookup(Name).Kind == CalleeBinding::CB_Intrinsic)
+			return fail(err_intrinsic_defined);
+		if (!check(Fn.getBody(), Proto.getArgs())) {
+			// a function no earlier item declared is forgotten again
+			if (R.second)
+				Table.Arity.erase(Name);
+			return false;
+		}
+		Table.Defined.insert(Name);
+		Table.Bindings[Name] = CalleeBinding{CalleeBinding::CB_Defined,
+			llvm::Intrinsic::not_intrinsic};
+		return true;
+	}
+
+	// generate Fn, which define() has accepted, into the current module,
+	// along with the imported bodies of the functions it calls. This may be
+	// long after the item was read: all it needs is the declarations that
+	// were there then, and they stay.
+	llvm::Function* emit(const FunctionAST& Fn) {
+		instrument::ScopedTimer Timer(instrument::T_Codegen);
+		const PrototypeAST& Proto = Fn.getProto();
+		SymbolID Name = Proto.getName();
+		// not getFunction(): Fn's own body is not to be imported
+		auto I = Functions.find(Name);
+		llvm::Function* F = I != Functions.end() && Name != sym_anon_expr
+			? I->second : declare(Name, Proto.getArgs().size());
+		nameArgs(F, Proto.getArgs());
+		emitBody(F, Fn);
+		importInlinable();
+		return F;
+	}
+
+	// generate the batch kernel of Fn, which define() has accepted, into the
+	// current module:
+	//
+	//   void Fn_batch(const double* const* Args, double* Out, size_t N)
+	//
+	// sets Out[I] to Fn(Args[0][I], Args[1][I], ...) for every I below N,
+	// the arguments given a column each. Fn's body is imported, as for the
+	// inliner, so that the optimizer can inline it into the loop, and then
+	// vectorize the loop.
+	llvm::Function* emitBatch(const FunctionAST& Fn) {
+		instrument::ScopedTimer Timer(instrument::T_Codegen);
+		const PrototypeAST& Proto = Fn.getProto();
+		SymbolID Name = Proto.getName();
+		unsigned NumArgs = Proto.getArgs().size();
+		auto I = Functions.find(Name);
+		llvm::Function* Scalar = I != Functions.end() ? I->second
+			: declare(Name, NumArgs);
+		if (Scalar->empty()) {
+			nameArgs(Scalar, Proto.getArgs());
+			emitBody(Scalar, Fn);
+			Scalar->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+			Imported.push_back(&Fn);
+			importInlinable();
+		}
+
+		llvm::Type* Double = llvm::Type::getDoubleTy(*Context);
+		llvm::PointerType* Column = llvm::PointerType::getUnqual(Double);
+		llvm::IntegerType* Size = Layout.getIntPtrType(*Context);
+		llvm::FunctionType* FT = llvm::FunctionType::get(
+			llvm::Type::getVoidTy(*Context),
+			{llvm::PointerType::getUnqual(Column), Column, Size}, false);
+		llvm::Function* F = llvm::Function::Create(FT,
+			llvm::Function::ExternalLinkage, Symbols.getName(Name) + "_batch",
+			M.get());
+		llvm::Argument* Args = F->getArg(0);
+		llvm::Argument* Out = F->getArg(1);
+		llvm::Argument* N = F->getArg(2);
+		Args->setName("args");
+		Out->setName("out");
+		N->setName("n");
+		// nothing else is written to, so the columns cannot change under the
+		// loop
+		Args->addAttr(llvm::Attribute::ReadOnly);
+		Out->addAttr(llvm::Attribute::NoAlias);
+
+		llvm::BasicBlock* Entry = llvm::BasicBlock::Create(*Context, "entry", F);
+		llvm::BasicBlock* Loop = llvm::BasicBlock::Create(*Context, "loop", F);
+		llvm::BasicBlock* Exit = llvm::BasicBlock::Create(*Context, "exit", F);
+		Builder->SetInsertPoint(Entry);
+		std::vector<llvm::Value*> Columns;
+		for (unsigned A = 0; A != NumArgs; ++A)
+			Columns.push_back(Builder->CreateLoad(Column,
+				Builder->CreateConstInBoundsGEP1_64(Column, Args, A),
+				Symbols.getName(Proto.getArgs()[A])));
+		Builder->CreateCondBr(Builder->CreateICmpEQ(N,
+			llvm::ConstantInt::get(Size, 0), "empty"), Exit, Loop);
+
+		Builder->SetInsertPoint(Loop);
+		llvm::PHINode* Row = Builder->CreatePHI(Size, 2, "i");
+		Row->addIncoming(llvm::ConstantInt::get(Size, 0), Entry);
+		std::vector<llvm::Value*> Values;
+		for (llvm::Value* C : Columns)
+			Values.push_back(Builder->CreateLoad(Double,
+				Builder->CreateInBoundsGEP(Double, C, Row), "argtmp"));
+		Builder->CreateStore(createCall(Scalar, Values),
+			Builder->CreateInBoundsGEP(Double, Out, Row));
+		llvm::Value* Next = Builder->CreateNUWAdd(Row,
+			llvm::ConstantInt::get(Size, 1), "next");
+		Row->addIncoming(Next, Loop);
+		Builder->CreateCondBr(Builder->CreateICmpEQ(Next, N, "done"), Exit, Loop);
+
+		Builder->SetInsertPoint(Exit);
+		Builder->CreateRetVoid();
+		return F;
+	}
+
+	// define Fn's function in the current module, along with the imported
+	// bodies of the functions it calls
+	llvm::Function* codegen(const FunctionAST& Fn) {
+		return define(Fn) ? emit(Fn) : nullptr;
+	}
+};
+
+#endif
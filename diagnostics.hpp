@@ -0,0 +1,237 @@
+#ifndef KALEIDOSCOPE_DIAGNOSTICS_HPP
+#define KALEIDOSCOPE_DIAGNOSTICS_HPP
+
+#include "source_buffer.hpp"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Diagnostics
+
+// every error the lexer, parser and code generator can report
+enum DiagID : uint8_t {
+	err_invalid_number,
+	err_expected_rparen,
+	err_expected_rparen_or_comma,
+	err_unknown_token,
+	err_expected_function_name,
+	err_expected_lparen_in_prototype,
+	err_expected_rparen_in_prototype,
+	// code generation, reported at the start of the item
+	err_unknown_variable,
+	err_unknown_function,
+	err_wrong_arg_count,
+	err_invalid_binary_operator,
+	err_function_redefined,
+	err_function_redeclared,
+	err_intrinsic_defined,
+	NumDiagIDs
+};
+
+// the message for ID; a '%' stands for the text of the token it is at
+inline const char* getDiagMessage(DiagID ID) {
+	static const char* const Messages[NumDiagIDs] = {
+		"invalid number '%'",
+		"expected ')'",
+		"Expected ')' or ',' in argument list",
+		"unknown token when expecting an expression",
+		"Expected function name in prototype",
+		"Expected '(' in prototype",
+		"Expected ')' in prototype",
+		"Unknown variable name",
+		"Unknown function referenced",
+		"Incorrect # arguments passed",
+		"invalid binary operator",
+		"Function cannot be redefined.",
+		"Function redeclared with a different number of arguments",
+		"Function cannot be defined: its extern is bound to an intrinsic"
+	};
+	return Messages[ID];
+}
+
+// an error, as reported: what it is and where. Length is the length of
+// the token at Offset, for messages that quote it.
+struct Diagnostic {
+	DiagID ID;
+	uint32_t Offset;
+	uint32_t Length;
+};
+
+// LineIndex -- maps source offsets to lines and columns. The line starts
+// are found only when a location is asked for, and only as far into the
+// source as that location, so a parse without errors never scans for
+// them. Safe to share between threads.
+class LineIndex {
+	const SourceBuffer& Source;
+	std::vector<uint32_t> LineStarts;
+	uint32_t Scanned = 0;  // line starts before here are in LineStarts
+	std::mutex Lock;
+
+	void scanToUnlocked(uint32_t Offset) {
+		if (Offset <= Scanned)
+			return;
+		const char* P = Source.at(Scanned);
+		const char* End = Source.at(Offset);
+		while (const char* NL = static_cast<const char*>(
+				memchr(P, '\n', End - P))) {
+			LineStarts.push_back(Source.offsetOf(NL + 1));
+			P = NL + 1;
+		}
+		Scanned = Offset;
+	}
+
+	public:
+	explicit LineIndex(const SourceBuffer& Source)
+		: Source(Source), LineStarts(1, 0) {}
+
+	// find the line starts up to Offset, which must be within the text read
+	// so far, as must everything after the last offset scanned to. Once it
+	// has been scanned, the text may be discarded.
+	void scanTo(uint32_t Offset) {
+		std::lock_guard<std::mutex> L(Lock);
+		scanToUnlocked(Offset);
+	}
+
+	// the 1-based line and column of Offset, which must have been scanned
+	// to, or else be within the text read so far (and not discarded)
+	std::pair<unsigned, unsigned> getLineAndColumn(uint32_t Offset) {
+		std::lock_guard<std::mutex> L(Lock);
+		scanToUnlocked(Offset);
+		auto Line = std::upper_bound(LineStarts.begin(), LineStarts.end(),
+			Offset) - 1;
+		return std::make_pair(unsigned(Line - LineStarts.begin()) + 1,
+			Offset - *Line + 1);
+	}
+};
+
+// DiagnosticEngine -- where the front end and codegen report errors. Each
+// error is recorded as a Diagnostic, and printed to the engine's stream as
+// an "Error: " line, with its line and column if the engine has a
+// LineIndex.
+//
+// The engine can stop printing after a number of errors, and can drop an
+// error that repeats the previous one (the same error on the same line),
+// which is what error recovery tends to produce on badly broken input.
+// Lines are told apart by the engine's LineIndex, or one given for
+// deduplication alone, or else by the newlines in the source between the
+// two errors. With none of those, as on a source that has been discarded,
+// nothing is dropped. Only printed errors are recorded, so a cap also
+// bounds the record.
+class DiagnosticEngine {
+	llvm::raw_ostream& OS;
+	const SourceBuffer* Source;  // for messages that quote the token
+	LineIndex* Lines;  // or nullptr, for no locations
+	LineIndex* DedupeLines = nullptr;  // for deduplication, if Lines is null
+
+	std::vector<Diagnostic> Diags;
+	unsigned MaxErrors = 0;  // 0 for no limit
+	bool Deduplicate = false;
+	unsigned NumErrors = 0;  // reported, printed or not
+	unsigned NumShown = 0;
+	bool Capped = false;  // whether the cap has been announced
+
+	// the previous error, for deduplication
+	bool HasLast = false;
+	DiagID LastID = NumDiagIDs;
+	uint32_t LastOffset = 0;
+
+	// whether Offset is on the line of the previous error
+	bool onLastLine(uint32_t Offset) const {
+		if (LineIndex* L = Lines ? Lines : DedupeLines)
+			return L->getLineAndColumn(Offset).first ==
+				L->getLineAndColumn(LastOffset).first;
+		if (!Source)
+			return false;
+		uint32_t Begin = std::min(Offset, LastOffset);
+		uint32_t End = std::max(Offset, LastOffset);
+		return !memchr(Source->at(Begin), '\n', End - Begin);
+	}
+
+	// whether D should be printed; counts it either way
+	bool admit(const Diagnostic& D) {
+		++NumErrors;
+		bool Repeat = Deduplicate && HasLast && D.ID == LastID &&
+			onLastLine(D.Offset);
+		HasLast = true;
+		LastID = D.ID;
+		LastOffset = D.Offset;
+		if (Repeat)
+			return false;
+		if (MaxErrors && NumShown == MaxErrors) {
+			if (!Capped)
+				OS << "Error: too many errors, not showing any more\n";
+			Capped = true;
+			return false;
+		}
+		++NumShown;
+		Diags.push_back(D);
+		return true;
+	}
+
+	public:
+	DiagnosticEngine(llvm::raw_ostream& OS, const SourceBuffer* Source = nullptr,
+			LineIndex* Lines = nullptr)
+		: OS(OS), Source(Source), Lines(Lines) {
+		Diags.reserve(64);
+	}
+
+	// the stream the errors go to, along with the parser's other output
+	llvm::raw_ostream& getStream() const { return OS; }
+	LineIndex* getLineIndex() const { return Lines; }
+
+	// print at most N errors; 0 for no limit
+	void setMaxErrors(unsigned N) {
+		MaxErrors = N;
+		if (N)
+			Diags.reserve(N);
+	}
+	void setDeduplicate(bool On) { Deduplicate = On; }
+	// tell lines apart by L for deduplication, where the engine has no
+	// LineIndex of its own (and prints no locations)
+	void setDedupeLines(LineIndex* L) { DedupeLines = L; }
+
+	// the errors printed so far
+	llvm::ArrayRef<Diagnostic> getDiagnostics() const { return Diags; }
+	unsigned getNumErrors() const { return NumErrors; }
+	// forget the errors recorded so far; the cap still counts them
+	void clear() { Diags.clear(); }
+
+	// print D to OS, as the engine does
+	void render(llvm::raw_ostream& Out, const Diagnostic& D) const {
+		Out << "Error: ";
+		if (Lines) {
+			std::pair<unsigned, unsigned> LC = Lines->getLineAndColumn(D.Offset);
+			Out << LC.first << ':' << LC.second << ": ";
+		}
+		llvm::StringRef Message = getDiagMessage(D.ID);
+		size_t Quote = Message.find('%');
+		if (Quote != llvm::StringRef::npos && Source)
+			Out << Message.substr(0, Quote)
+				<< llvm::StringRef(Source->at(D.Offset), D.Length)
+				<< Message.substr(Quote + 1);
+		else
+			Out << Message;
+		Out << '\n';
+	}
+
+	void report(DiagID ID, uint32_t Offset, uint32_t Length = 0) {
+		Diagnostic D{ID, Offset, Length};
+		if (admit(D))
+			render(OS, D);
+	}
+
+	// report D, already rendered as Text by another engine (one that had
+	// the source D quotes, while this one hasn't)
+	void reportRendered(const Diagnostic& D, llvm::StringRef Text) {
+		if (admit(D))
+			OS << Text;
+	}
+};
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef KALEIDOSCOPE_EXTERN_TABLE_HPP
+#define KALEIDOSCOPE_EXTERN_TABLE_HPP
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include <type_traits>
+#include <utility>
+
+// Extern bindings
+
+// ExternTable -- what the calls to an extern are bound to, by its name:
+//
+//   - for the C library math functions with an instruction or an
+//     intrinsic of their own (sin, cos, sqrt, exp, log, ...), that
+//     intrinsic. The optimizer knows those have no side effects, so it may
+//     fold, combine and hoist them, and the loop vectorizer may replace
+//     them with a vector math library's, as it does in batch kernels.
+//     Compiled as calls, they still call the C library's.
+//   - for the host functions given to add(), the function itself, at its
+//     address: the JIT is told it, so it is not looked up with dlsym, and
+//     need not even be exported.
+//   - for any other name, nothing: the JIT looks it up in the process.
+//
+// An intrinsic is only used for an extern the program declared: a function
+// of that name that the program defines first is called as any other, and
+// one declared first may not be defined after.
+class ExternTable {
+	public:
+	struct Binding {
+		unsigned NumArgs;
+		// the intrinsic, for a math function, or else not_intrinsic
+		llvm::Intrinsic::ID Intrinsic;
+		// the host function, if it is one
+		llvm::JITTargetAddress Address;
+	};
+
+	private:
+	llvm::StringMap<Binding> Bindings;
+
+	template <typename... ArgTs> struct AllDoubles;
+
+	void addIntrinsic(llvm::StringRef Name, unsigned NumArgs,
+			llvm::Intrinsic::ID ID) {
+		Bindings[Name] = Binding{NumArgs, ID, 0};
+	}
+
+	public:
+	// a table of the math functions alone
+	ExternTable() {
+		addIntrinsic("sqrt", 1, llvm::Intrinsic::sqrt);
+		addIntrinsic("sin", 1, llvm::Intrinsic::sin);
+		addIntrinsic("cos", 1, llvm::Intrinsic::cos);
+		addIntrinsic("exp", 1, llvm::Intrinsic::exp);
+		addIntrinsic("exp2", 1, llvm::Intrinsic::exp2);
+		addIntrinsic("log", 1, llvm::Intrinsic::log);
+		addIntrinsic("log2", 1, llvm::Intrinsic::log2);
+		addIntrinsic("log10", 1, llvm::Intrinsic::log10);
+		addIntrinsic("pow", 2, llvm::Intrinsic::pow);
+		addIntrinsic("fabs", 1, llvm::Intrinsic::fabs);
+		addIntrinsic("floor", 1, llvm::Intrinsic::floor);
+		addIntrinsic("ceil", 1, llvm::Intrinsic::ceil);
+		addIntrinsic("trunc", 1, llvm::Intrinsic::trunc);
+		addIntrinsic("round", 1, llvm::Intrinsic::round);
+		addIntrinsic("fmin", 2, llvm::Intrinsic::minnum);
+		addIntrinsic("fmax", 2, llvm::Intrinsic::maxnum);
+	}
+
+	// bind Name to Fn, a host function of doubles, in place of a math
+	// function of that name if there is one. Calls to Name need no extern
+	// then, and it may not be defined.
+	template <typename... ArgTs> void add(llvm::StringRef Name,
+			double (*Fn)(ArgTs...)) {
+		static_assert(AllDoubles<ArgTs...>::value,
+			"Kaleidoscope only passes doubles");
+		Bindings[Name] = Binding{unsigned(sizeof...(ArgTs)),
+			llvm::Intrinsic::not_intrinsic, llvm::pointerToJITTargetAddress(Fn)};
+	}
+
+	// Name's binding, or nullptr if it has none
+	const Binding* lookup(llvm::StringRef Name) const {
+		auto I = Bindings.find(Name);
+		return I != Bindings.end() ? &I->second : nullptr;
+	}
+
+	// every binding, by name
+	const llvm::StringMap<Binding>& getBindings() const { return Bindings; }
+
+	// load the glibc vector math library, libmvec, into the process, for
+	// the vector math functions the loop vectorizer may call in place of
+	// those above; false if there is none to load
+	static bool loadVectorMathLibrary() {
+		return !llvm::sys::DynamicLibrary::LoadLibraryPermanently(
+			"libmvec.so.1");
+	}
+};
+
+template <typename... ArgTs> struct ExternTable::AllDoubles
+	: std::true_type {};
+template <typename ArgT, typename... ArgTs>
+struct ExternTable::AllDoubles<ArgT, ArgTs...>
+	: std::integral_constant<bool, std::is_same<ArgT, double>::value &&
+		AllDoubles<ArgTs...>::value> {};
+
+#endif
@@ -0,0 +1,291 @@
+#ifndef KALEIDOSCOPE_FLAT_AST_HPP
+#define KALEIDOSCOPE_FLAT_AST_HPP
+
+#include "ast.hpp"
+#include "symbol_table.hpp"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Flat AST
+
+// the index of a node in a FlatAST
+typedef uint32_t NodeIndex;
+
+// one expression node: a fixed-size record whose children are indices
+// into the same array rather than pointers
+struct FlatExpr {
+	uint8_t Kind;  // an ExprAST::ExprKind
+	char Op;  // EK_Binary: the operator
+	uint16_t Reserved;
+	// EK_Number:   A = index into Constants
+	// EK_Variable: A = the SymbolID
+	// EK_Binary:   A = LHS, B = RHS
+	// EK_Call:     A = the callee's SymbolID, B = index into Args of the
+	//              argument count, which is followed by the arguments
+	uint32_t A, B;
+
+	ExprAST::ExprKind getKind() const { return ExprAST::ExprKind(Kind); }
+};
+static_assert(sizeof(FlatExpr) == 12, "FlatExpr should pack into 12 bytes");
+
+// a top-level item in a FlatAST
+struct FlatItem {
+	enum ItemKind : uint32_t {
+		FI_Definition,
+		FI_Extern,
+		FI_TopLevelExpr
+	};
+	ItemKind Kind;
+	uint32_t Proto;  // index into Protos of the prototype
+	NodeIndex Body;  // the root of the body, unless FI_Extern
+};
+static_assert(sizeof(FlatItem) == 12, "FlatItem should pack into 12 bytes");
+
+// FlatASTView -- read-only access to flat AST arrays, wherever they are
+// stored: in a FlatAST, or mapped straight from an AST cache file.
+class FlatASTView {
+	llvm::ArrayRef<FlatExpr> Nodes;
+	llvm::ArrayRef<uint32_t> Args;
+	llvm::ArrayRef<double> Constants;
+	// each prototype is its name, its argument count, then its arguments
+	llvm::ArrayRef<uint32_t> Protos;
+	llvm::ArrayRef<FlatItem> Items;
+
+	public:
+	FlatASTView() = default;
+	FlatASTView(llvm::ArrayRef<FlatExpr> Nodes, llvm::ArrayRef<uint32_t> Args,
+			llvm::ArrayRef<double> Constants, llvm::ArrayRef<uint32_t> Protos,
+			llvm::ArrayRef<FlatItem> Items)
+		: Nodes(Nodes), Args(Args), Constants(Constants), Protos(Protos),
+		Items(Items) {}
+
+	const FlatExpr& operator[](NodeIndex I) const { return Nodes[I]; }
+	size_t size() const { return Nodes.size(); }
+	llvm::ArrayRef<FlatExpr> nodes() const { return Nodes; }
+	llvm::ArrayRef<uint32_t> args() const { return Args; }
+	llvm::ArrayRef<double> constants() const { return Constants; }
+	llvm::ArrayRef<uint32_t> protos() const { return Protos; }
+	llvm::ArrayRef<FlatItem> items() const { return Items; }
+
+	double getConstant(const FlatExpr& N) const { return Constants[N.A]; }
+	llvm::ArrayRef<uint32_t> getArgs(const FlatExpr& N) const {
+		return Args.slice(N.B + 1, Args[N.B]);
+	}
+
+	SymbolID getProtoName(uint32_t Proto) const { return Protos[Proto]; }
+	llvm::ArrayRef<SymbolID> getProtoArgs(uint32_t Proto) const {
+		return Protos.slice(Proto + 2, Protos[Proto + 1]);
+	}
+
+	// bytes used by the arrays' contents
+	size_t getMemorySize() const {
+		return Nodes.size() * sizeof(FlatExpr) + Args.size() * sizeof(uint32_t)
+			+ Constants.size() * sizeof(double)
+			+ Protos.size() * sizeof(uint32_t) + Items.size() * sizeof(FlatItem);
+	}
+};
+
+// FlatAST -- expression trees stored as one contiguous node array plus
+// side arrays for call arguments and constants. Nodes are appended in
+// postorder, so every child comes before its parent and a walk from
+// front to back visits operands before the operations that use them.
+// Any number of trees can share one FlatAST; each is named by the index
+// of its root. Top-level items, with their prototypes, can be recorded
+// too, which makes a FlatAST a complete parse of a source.
+class FlatAST {
+	std::vector<FlatExpr> Nodes;
+	std::vector<uint32_t> Args;
+	std::vector<double> Constants;
+	std::vector<uint32_t> Protos;
+	std::vector<FlatItem> Items;
+
+	NodeIndex push(ExprAST::ExprKind Kind, char Op, uint32_t A, uint32_t B) {
+		Nodes.push_back(FlatExpr{uint8_t(Kind), Op, 0, A, B});
+		return Nodes.size() - 1;
+	}
+
+	public:
+	// append a copy of the tree under E and return the index of its root
+	NodeIndex append(const ExprAST* E) {
+		// each entry is a node and the number of its children appended so
+		// far; the appended children wait on Operands
+		llvm::SmallVector<std::pair<const ExprAST*, unsigned>, 32> Stack;
+		llvm::SmallVector<NodeIndex, 32> Operands;
+		Stack.push_back(std::make_pair(E, 0u));
+		while (!Stack.empty()) {
+			const ExprAST* N = Stack.back().first;
+			unsigned Child = Stack.back().second++;
+			const ExprAST* Next = nullptr;
+			NodeIndex Done = 0;
+			switch (N->getKind()) {
+			case ExprAST::EK_Number:
+				Constants.push_back(llvm::cast<NumberExprAST>(N)->getVal());
+				Done = push(ExprAST::EK_Number, 0, Constants.size() - 1, 0);
+				break;
+			case ExprAST::EK_Variable:
+				Done = push(ExprAST::EK_Variable, 0,
+					llvm::cast<VariableExprAST>(N)->getName(), 0);
+				break;
+			case ExprAST::EK_Binary: {
+				auto B = llvm::cast<BinaryExprAST>(N);
+				if (Child < 2) {
+					Next = Child == 0 ? B->getLHS() : B->getRHS();
+					break;
+				}
+				NodeIndex RHS = Operands.pop_back_val();
+				NodeIndex LHS = Operands.pop_back_val();
+				Done = push(ExprAST::EK_Binary, B->getOp(), LHS, RHS);
+				break;
+			}
+			case ExprAST::EK_Call: {
+				auto C = llvm::cast<CallExprAST>(N);
+				size_t NumArgs = C->getArgs().size();
+				if (Child < NumArgs) {
+					Next = C->getArgs()[Child];
+					break;
+				}
+				uint32_t First = Args.size();
+				Args.push_back(NumArgs);
+				Args.insert(Args.end(), Operands.end() - NumArgs, Operands.end());
+				Operands.resize(Operands.size() - NumArgs);
+				Done = push(ExprAST::EK_Call, 0, C->getCallee(), First);
+				break;
+			}
+			}
+			if (Next) {
+				Stack.push_back(std::make_pair(Next, 0u));
+				continue;
+			}
+			Stack.pop_back();
+			Operands.push_back(Done);
+		}
+		return Operands.back();
+	}
+
+	// append a copy of Proto and return its index
+	uint32_t append(const PrototypeAST& Proto) {
+		uint32_t Index = Protos.size();
+		Protos.push_back(Proto.getName());
+		Protos.push_back(Proto.getArgs().size());
+		Protos.insert(Protos.end(), Proto.getArgs().begin(),
+			Proto.getArgs().end());
+		return Index;
+	}
+
+	// record a top-level item, appending its prototype and body. Item must
+	// have parsed, and not be a ';'.
+	const FlatItem& addItem(const TopLevelItem& Item) {
+		FlatItem::ItemKind Kind = FlatItem::FI_Extern;
+		const PrototypeAST* Proto = Item.Proto.get();
+		const ExprAST* Body = nullptr;
+		if (Item.Function) {
+			Kind = Item.Kind == TopLevelItem::TK_Definition
+				? FlatItem::FI_Definition : FlatItem::FI_TopLevelExpr;
+			Proto = &Item.Function->getProto();
+			Body = Item.Function->getBody();
+		}
+		uint32_t P = append(*Proto);
+		NodeIndex B = Body ? append(Body) : 0;
+		Items.push_back(FlatItem{Kind, P, B});
+		return Items.back();
+	}
+
+	// the view is invalidated by the next append
+	FlatASTView view() const {
+		return FlatASTView(Nodes, Args, Constants, Protos, Items);
+	}
+	size_t size() const { return Nodes.size(); }
+};
+
+// print the tree rooted at Root as an s-expression, exactly as printExpr
+// prints the pointer tree it was made from
+inline void printExpr(llvm::raw_ostream& OS, const SymbolTable& Symbols,
+		const FlatASTView& AST, NodeIndex Root) {
+	llvm::SmallVector<std::pair<NodeIndex, unsigned>, 32> Stack;
+	Stack.push_back(std::make_pair(Root, 0u));
+	while (!Stack.empty()) {
+		const FlatExpr& N = AST[Stack.back().first];
+		unsigned Child = Stack.back().second++;
+		bool HasNext = false;
+		NodeIndex Next = 0;
+		switch (N.getKind()) {
+		case ExprAST::EK_Number:
+			OS << llvm::format("%g", AST.getConstant(N));
+			break;
+		case ExprAST::EK_Variable:
+			OS << Symbols.getName(N.A);
+			break;
+		case ExprAST::EK_Binary:
+			if (Child == 0) {
+				OS << '(' << N.Op << ' ';
+				HasNext = true;
+				Next = N.A;
+			}
+			else if (Child == 1) {
+				OS << ' ';
+				HasNext = true;
+				Next = N.B;
+			}
+			else
+				OS << ')';
+			break;
+		case ExprAST::EK_Call: {
+			llvm::ArrayRef<uint32_t> Args = AST.getArgs(N);
+			if (Child == 0)
+				OS << '(' << Symbols.getName(N.A);
+			if (Child < Args.size()) {
+				OS << ' ';
+				HasNext = true;
+				Next = Args[Child];
+			}
+			else
+				OS << ')';
+			break;
+		}
+		}
+		if (HasNext)
+			Stack.push_back(std::make_pair(Next, 0u));
+		else
+			Stack.pop_back();
+	}
+}
+
+inline void printProto(llvm::raw_ostream& OS, const SymbolTable& Symbols,
+		const FlatASTView& AST, uint32_t Proto) {
+	llvm::ArrayRef<SymbolID> Args = AST.getProtoArgs(Proto);
+	OS << Symbols.getName(AST.getProtoName(Proto)) << " (";
+	for (unsigned I = 0, E = Args.size(); I != E; ++I)
+		OS << (I ? " " : "") << Symbols.getName(Args[I]);
+	OS << ')';
+}
+
+// print a top-level item as -dump-ast does
+inline void printItem(llvm::raw_ostream& OS, const SymbolTable& Symbols,
+		const FlatASTView& AST, const FlatItem& Item) {
+	switch (Item.Kind) {
+	case FlatItem::FI_Definition:
+		OS << "(def ";
+		printProto(OS, Symbols, AST, Item.Proto);
+		OS << ' ';
+		printExpr(OS, Symbols, AST, Item.Body);
+		OS << ")\n";
+		break;
+	case FlatItem::FI_Extern:
+		OS << "(extern ";
+		printProto(OS, Symbols, AST, Item.Proto);
+		OS << ")\n";
+		break;
+	case FlatItem::FI_TopLevelExpr:
+		printExpr(OS, Symbols, AST, Item.Body);
+		OS << '\n';
+		break;
+	}
+}
+
+#endif
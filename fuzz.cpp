@@ -0,0 +1,346 @@
+#include "ast.hpp"
+#include "diagnostics.hpp"
+#include "lexer.hpp"
+#include "memory_usage.hpp"
+#include "parser.hpp"
+#include "source_buffer.hpp"
+#include "symbol_table.hpp"
+#include "workloads.hpp"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Fuzz and stress tests for the front end
+//
+// LLVMFuzzerTestOneInput() lexes and parses one input, given as a buffer,
+// twice: with the recursive parser straight from the Lexer, as ch2 and ch3
+// do by default, and with the iterative parser over a TokenBuffer. Each
+// parse is printed as -dump-ast prints it, and its errors are kept. If the
+// two disagree, it prints both and aborts; a crash or a hang in either is
+// reported by the fuzzer itself.
+//
+// Built with "make fuzz" it is a libFuzzer target. Otherwise main() runs
+// it on each file named, or on stdin, which is what AFL expects of a
+// target ("make toy_fuzz CC=afl-clang-fast++").
+//
+// With -stress, main() instead times both parses on each workload, the
+// well-formed ones and the malformed ones, at sizes doubling up to -size.
+// It reports the worst time and the worst growth in resident memory per
+// input byte. A figure that rises with the size marks an input that costs
+// more than linear time or memory.
+
+// ======   the fuzz target
+
+static void configure(Parser& P, bool Iterative) {
+	P.setBinopPrecedence('<', 10);
+	P.setBinopPrecedence('+', 20);
+	P.setBinopPrecedence('-', 20);
+	P.setBinopPrecedence('*', 40);
+	P.setIterative(Iterative);
+	P.setReportItems(false);
+}
+
+// parse every top-level item of P's input, printing each to Dump if there
+// is one
+static void parseAll(Parser& P, const SymbolTable& Symbols,
+		llvm::raw_ostream* Dump) {
+	P.getNextToken();
+	while (P.getCurTok() != tok_eof) {
+		TopLevelItem Item = P.ParseTopLevelItem();
+		if (Dump)
+			printItem(*Dump, Symbols, Item);
+	}
+}
+
+// parse Source with the recursive parser, from tokens as the Lexer
+// produces them
+static void parseStreamed(SourceBuffer& Source, DiagnosticEngine& Diags,
+		llvm::raw_ostream* Dump) {
+	SymbolTable Symbols;
+	Lexer Lex(Source, Symbols, Diags);
+	Parser P(Lex, Diags);
+	configure(P, false);
+	parseAll(P, Symbols, Dump);
+}
+
+// lex all of Source into a TokenBuffer, and parse that with the iterative
+// parser
+static void parseBuffered(SourceBuffer& Source, DiagnosticEngine& Diags,
+		llvm::raw_ostream* Dump) {
+	SymbolTable Symbols;
+	TokenBuffer Tokens;
+	Lexer(Source, Symbols, Diags).lexAll(Tokens);
+	Parser P(Tokens, 0, Tokens.size(), Diags);
+	configure(P, true);
+	parseAll(P, Symbols, Dump);
+}
+
+// a parse, as -dump-ast prints it, and its errors in the order they were
+// reported
+struct ParseTrace {
+	std::string AST;
+	std::vector<Diagnostic> Errors;
+};
+
+template <typename Fn>
+static ParseTrace trace(SourceBuffer& Source, Fn Parse) {
+	ParseTrace T;
+	llvm::raw_string_ostream Dump(T.AST);
+	DiagnosticEngine Diags(llvm::nulls());
+	Parse(Source, Diags, &Dump);
+	Dump.flush();
+	llvm::ArrayRef<Diagnostic> Errors = Diags.getDiagnostics();
+	T.Errors.assign(Errors.begin(), Errors.end());
+	return T;
+}
+
+static bool operator==(const Diagnostic& A, const Diagnostic& B) {
+	return A.ID == B.ID && A.Offset == B.Offset && A.Length == B.Length;
+}
+
+static void printTrace(llvm::raw_ostream& OS, const char* Name,
+		const ParseTrace& T) {
+	OS << "=== " << Name << " parse\n" << T.AST;
+	for (const Diagnostic& D : T.Errors)
+		OS << "error at " << D.Offset << ": " << getDiagMessage(D.ID) << '\n';
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* Data, size_t Size) {
+	std::unique_ptr<SourceBuffer> Source =
+		SourceBuffer::fromString(reinterpret_cast<const char*>(Data), Size);
+	if (!Source)
+		return 0;
+	ParseTrace Streamed = trace(*Source, parseStreamed);
+	ParseTrace Buffered = trace(*Source, parseBuffered);
+	if (Streamed.AST != Buffered.AST || Streamed.Errors != Buffered.Errors) {
+		llvm::errs() << "the recursive and iterative parses differ\n";
+		printTrace(llvm::errs(), "recursive", Streamed);
+		printTrace(llvm::errs(), "iterative", Buffered);
+		llvm::errs().flush();
+		abort();
+	}
+	return 0;
+}
+
+#ifndef KS_LIBFUZZER
+
+// ======   stress mode
+
+static llvm::cl::opt<bool> Stress("stress",
+	llvm::cl::desc("Measure the worst time and memory per byte on the "
+		"workloads instead"));
+
+static llvm::cl::opt<unsigned> SizeKB("size",
+	llvm::cl::desc("With -stress, the largest size of each workload, in "
+		"kilobytes"),
+	llvm::cl::init(4096));
+
+static llvm::cl::opt<unsigned> MinSizeKB("min-size",
+	llvm::cl::desc("With -stress, the smallest size of each workload, in "
+		"kilobytes"),
+	llvm::cl::init(64));
+
+static llvm::cl::opt<unsigned> Seed("seed",
+	llvm::cl::desc("Seed for the workload generators"), llvm::cl::init(1));
+
+static llvm::cl::list<std::string> Only("workload",
+	llvm::cl::desc("With -stress, run only these workloads"),
+	llvm::cl::CommaSeparated);
+
+static llvm::cl::opt<double> MaxNsPerByte("max-ns-per-byte",
+	llvm::cl::desc("With -stress, fail if a parse takes longer than this "
+		"per byte; 0 for no limit"),
+	llvm::cl::init(0));
+
+static llvm::cl::opt<double> MaxRSSPerByte("max-rss-per-byte",
+	llvm::cl::desc("With -stress, fail if a parse grows the resident set by "
+		"more than this many bytes per input byte; 0 for no limit"),
+	llvm::cl::init(0));
+
+static llvm::cl::list<std::string> InputFiles(llvm::cl::Positional,
+	llvm::cl::desc("<input files>"));
+
+struct Workload {
+	const char* Name;
+	void (*Generate)(std::string& Out, size_t Size, uint64_t Seed);
+};
+
+static const Workload Workloads[] = {
+	{"chains", [](std::string& Out, size_t Size, uint64_t Seed) {
+		genOperatorChains(Out, Size, Seed);
+	}},
+	{"parens", [](std::string& Out, size_t Size, uint64_t Seed) {
+		genDeepParens(Out, Size, Seed);
+	}},
+	{"calls", [](std::string& Out, size_t Size, uint64_t Seed) {
+		genWideCalls(Out, Size, Seed);
+	}},
+	{"defs", genManyDefs},
+	{"externs", genManyExterns},
+	{"tables", [](std::string& Out, size_t Size, uint64_t Seed) {
+		genNumericTables(Out, Size, Seed);
+	}},
+	{"unclosed", [](std::string& Out, size_t Size, uint64_t Seed) {
+		genUnclosedParens(Out, Size, Seed);
+	}},
+	{"badnums", genBadNumbers},
+	{"longtoks", [](std::string& Out, size_t Size, uint64_t Seed) {
+		genLongTokens(Out, Size, Seed);
+	}},
+	{"soup", genTokenSoup},
+};
+
+static double now() {
+	return std::chrono::duration<double>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// the cost of one parse of an input, per input byte
+struct Cost {
+	double NsPerByte;
+	double RSSPerByte;  // growth of the peak resident set over the parse
+};
+
+template <typename Fn>
+static Cost measure(const std::string& Text, Fn Parse) {
+	std::unique_ptr<SourceBuffer> Source =
+		SourceBuffer::fromString(Text.data(), Text.size());
+	resetPeakRSS();
+	size_t Before = getCurrentRSS();
+	double Start = now();
+	{
+		DiagnosticEngine Diags(llvm::nulls());
+		Parse(*Source, Diags, nullptr);
+	}
+	double Seconds = now() - Start;
+	size_t Peak = getPeakRSS();
+	double Bytes = std::max<size_t>(Text.size(), 1);
+	return Cost{Seconds * 1e9 / Bytes,
+		Before && Peak > Before ? (Peak - Before) / Bytes : 0};
+}
+
+// the worst cost seen for one parse over all of a workload's sizes
+struct Worst {
+	Cost Smallest{0, 0};  // at the smallest size, to compare the rest to
+	Cost Max{0, 0};
+	size_t NsAt = 0, RSSAt = 0;  // the sizes the maxima were seen at
+
+	void add(size_t Size, const Cost& C) {
+		if (!NsAt)
+			Smallest = C;
+		if (!NsAt || C.NsPerByte > Max.NsPerByte) {
+			Max.NsPerByte = C.NsPerByte;
+			NsAt = Size;
+		}
+		if (!RSSAt || C.RSSPerByte > Max.RSSPerByte) {
+			Max.RSSPerByte = C.RSSPerByte;
+			RSSAt = Size;
+		}
+	}
+};
+
+static unsigned NumFailures = 0;
+
+static void report(const std::string& Name, const char* Parse,
+		const Worst& W) {
+	double Growth = W.Smallest.NsPerByte > 0
+		? W.Max.NsPerByte / W.Smallest.NsPerByte : 1;
+	llvm::outs() << llvm::format("%-10s %-9s %9.2f %8zuK %6.1fx %9.2f %8zuK",
+		Name.c_str(), Parse, W.Max.NsPerByte, W.NsAt >> 10, Growth,
+		W.Max.RSSPerByte, W.RSSAt >> 10);
+	bool Slow = MaxNsPerByte > 0 && W.Max.NsPerByte > MaxNsPerByte;
+	bool Big = MaxRSSPerByte > 0 && W.Max.RSSPerByte > MaxRSSPerByte;
+	if (Slow || Big) {
+		llvm::outs() << (Slow ? "  too slow" : "") << (Big ? "  too big" : "");
+		++NumFailures;
+	}
+	llvm::outs() << '\n';
+}
+
+// measure both parses on Generate's output at each size from MinSize up
+// to MaxSize, doubling
+static void stress(const std::string& Name,
+		const std::function<void(std::string&, size_t)>& Generate,
+		size_t MinSize, size_t MaxSize) {
+	Worst Recursive, Iterative;
+	for (size_t Size = MinSize; Size <= MaxSize; Size *= 2) {
+		std::string Text;
+		Generate(Text, Size);
+		Recursive.add(Size, measure(Text, parseStreamed));
+		Iterative.add(Size, measure(Text, parseBuffered));
+	}
+	report(Name, "recursive", Recursive);
+	report(Name, "iterative", Iterative);
+	llvm::outs().flush();
+}
+
+static void runStress() {
+	llvm::outs() << "input      parse       ns/B   at size  growth  rss B/B"
+		"   at size\n";
+	size_t MaxSize = size_t(SizeKB) << 10;
+	size_t MinSize = std::min(size_t(std::max(1u, unsigned(MinSizeKB))) << 10,
+		MaxSize);
+	for (const Workload& W : Workloads) {
+		if (!Only.empty() &&
+				std::find(Only.begin(), Only.end(), W.Name) == Only.end())
+			continue;
+		stress(W.Name, [&](std::string& Out, size_t Size) {
+			W.Generate(Out, Size, Seed);
+		}, MinSize, MaxSize);
+	}
+
+	// each input file, repeated up to each size
+	for (const std::string& Path : InputFiles) {
+		auto File = llvm::MemoryBuffer::getFile(Path);
+		if (!File || !(*File)->getBufferSize()) {
+			llvm::errs() << Path << ": can't read it, or it's empty\n";
+			++NumFailures;
+			continue;
+		}
+		llvm::StringRef Text = (*File)->getBuffer();
+		stress(Path, [&](std::string& Out, size_t Size) {
+			while (Out.size() < Size) {
+				Out.append(Text.begin(), Text.end());
+				Out += '\n';
+			}
+		}, std::max(MinSize, Text.size()), std::max(MaxSize, Text.size()));
+	}
+}
+
+// ======   driver
+
+int main(int argc, char** argv) {
+	llvm::cl::ParseCommandLineOptions(argc, argv,
+		"Kaleidoscope front-end fuzz target and stress tests\n");
+
+	if (Stress) {
+		runStress();
+		return NumFailures ? 1 : 0;
+	}
+
+	// run the fuzz target on each input, or on stdin
+	if (InputFiles.empty())
+		InputFiles.push_back("-");
+	for (const std::string& Path : InputFiles) {
+		auto File = llvm::MemoryBuffer::getFileOrSTDIN(Path);
+		if (!File) {
+			llvm::errs() << Path << ": " << File.getError().message() << '\n';
+			return 1;
+		}
+		LLVMFuzzerTestOneInput(
+			reinterpret_cast<const uint8_t*>((*File)->getBufferStart()),
+			(*File)->getBufferSize());
+	}
+	return 0;
+}
+
+#endif
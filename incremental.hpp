@@ -0,0 +1,159 @@
+#ifndef KALEIDOSCOPE_INCREMENTAL_HPP
+#define KALEIDOSCOPE_INCREMENTAL_HPP
+
+#include "ast.hpp"
+#include "diagnostics.hpp"
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "source_buffer.hpp"
+#include "symbol_table.hpp"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Incremental parsing
+
+// IncrementalParser -- a source buffer and its parse, kept up to date as
+// the buffer is edited.
+//
+// The parse is kept as a list of top-level items, each with its source
+// range and what parsing it printed. No item depends on the one before:
+// the parser starts every item from scratch at its first token, and the
+// lexer has no state besides its position. So after an edit, only the
+// items from the one before the edit onwards are re-parsed, and only
+// until the parse arrives at the start of an old item past the edit. From
+// there everything is as it was, and the old items are kept, just moved.
+// (The item before the edit is included because its parse lexed the first
+// token of the next one.)
+//
+// Editing still moves the text after the edit, and the offsets of the
+// items there, but that is a memmove and an add per item rather than a
+// lex and parse of the whole buffer.
+class IncrementalParser {
+	public:
+	struct Item {
+		// from the item's first token up to the next item's first token (or
+		// the end of the input), so the ranges tile the input after Leading
+		uint32_t Begin, End;
+		TopLevelItem Parsed;
+		// everything parsing the item printed
+		std::string Messages;
+	};
+
+	private:
+	std::unique_ptr<SourceBuffer> Source;
+	SymbolTable Symbols;
+	std::function<void(Parser&)> Configure;
+
+	std::string Leading;  // what lexing the first token printed
+	std::vector<Item> Items;
+	unsigned LastReparsed = 0;
+
+	// parse the items from Offset, which is at Items[First] (or at 0, if
+	// First is 0), until the end of the input or until an item starts at
+	// Resync or beyond where an old item started. Old items are at their
+	// offsets before the edit, and Delta converts those to current ones.
+	void reparse(size_t First, uint32_t Resync, int64_t Delta) {
+		std::string Buffer;
+		llvm::raw_string_ostream Messages(Buffer);
+		DiagnosticEngine Diags(Messages, Source.get());
+		Lexer Lex(*Source, Symbols, Diags);
+		Parser P(Lex, Diags);
+		Configure(P);
+
+		uint32_t Offset = First ? Items[First].Begin : 0;
+		Lex.seek(Offset);
+		P.getNextToken();
+		Messages.flush();
+		if (!First)
+			Leading = std::move(Buffer);
+		// otherwise the first token and its messages are unchanged, and
+		// belong to Items[First - 1]
+		Buffer.clear();
+
+		std::vector<Item> New;
+		size_t Old = First;  // the next old item that might be reused
+		while (P.getCurTok() != tok_eof) {
+			uint32_t Begin = P.getTokOffset();
+			if (Begin >= Resync) {
+				while (Old < Items.size() && Items[Old].Begin + Delta < Begin)
+					++Old;
+				if (Old < Items.size() && Items[Old].Begin + Delta == Begin)
+					break;
+			}
+			New.push_back(Item{Begin, 0, P.ParseTopLevelItem(), ""});
+			Messages.flush();
+			New.back().End = P.getTokOffset();
+			New.back().Messages = std::move(Buffer);
+			Buffer.clear();
+		}
+		if (P.getCurTok() == tok_eof)
+			Old = Items.size();
+
+		LastReparsed = New.size();
+		for (size_t I = Old; I != Items.size(); ++I) {
+			Items[I].Begin += Delta;
+			Items[I].End += Delta;
+		}
+		Items.erase(Items.begin() + First, Items.begin() + Old);
+		Items.insert(Items.begin() + First, std::make_move_iterator(New.begin()),
+			std::make_move_iterator(New.end()));
+	}
+
+	public:
+	// Configure sets up each parser, e.g. with its binary operators
+	IncrementalParser(std::unique_ptr<SourceBuffer> Source,
+			std::function<void(Parser&)> Configure)
+		: Source(std::move(Source)), Configure(std::move(Configure)) {
+		reparse(0, 0, 0);
+	}
+
+	llvm::StringRef getText() const {
+		return llvm::StringRef(Source->begin(), Source->size());
+	}
+	const SymbolTable& getSymbols() const { return Symbols; }
+	const std::vector<Item>& getItems() const { return Items; }
+	// the number of items the last parse or edit had to parse
+	unsigned getLastReparsed() const { return LastReparsed; }
+
+	// replace Length bytes at Offset with Text, and bring the parse up to
+	// date. Returns false if the edit is out of range or the buffer could
+	// not grow.
+	bool edit(size_t Offset, size_t Length, llvm::StringRef Text) {
+		if (Offset > Source->size() || Length > Source->size() - Offset)
+			return false;
+		if (!Source->replace(Offset, Length, Text.data(), Text.size()))
+			return false;
+
+		// the item before the one holding the byte before the edit (which
+		// may be the edit's first, if the edit is at the start of an item)
+		uint32_t Before = Offset ? Offset - 1 : 0;
+		auto It = std::upper_bound(Items.begin(), Items.end(), Before,
+			[](uint32_t Off, const Item& I) { return Off < I.Begin; });
+		size_t Holding = It - Items.begin();
+		size_t First = Holding >= 2 ? Holding - 2 : 0;
+
+		reparse(First, Offset + Text.size(),
+			int64_t(Text.size()) - int64_t(Length));
+		return true;
+	}
+
+	// print everything the parse printed, exactly as the parser driver's
+	// MainLoop prints it for the same input (or, without Prompts, as it
+	// prints it in batch mode)
+	void printMessages(llvm::raw_ostream& OS, bool Prompts = true) const {
+		const char* Prompt = Prompts ? "ready> " : "";
+		OS << Prompt << Leading;
+		for (const Item& I : Items)
+			OS << Prompt << I.Messages;
+		OS << Prompt;
+	}
+};
+
+#endif
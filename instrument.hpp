@@ -0,0 +1,309 @@
+#ifndef KALEIDOSCOPE_INSTRUMENT_HPP
+#define KALEIDOSCOPE_INSTRUMENT_HPP
+
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+
+#ifdef KS_INSTRUMENT
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#endif
+
+// Instrumentation
+//
+// Counters and timers on the hot paths of the front end and the JIT,
+// reported as JSON or as a Chrome trace (chrome://tracing, or
+// ui.perfetto.dev). Built with KS_INSTRUMENT defined (make INSTRUMENT=1),
+// every thread counts into its own block, so nothing on a hot path takes
+// a lock. Built without it, count(), countToken() and ScopedTimer are
+// empty inline functions, and cost nothing.
+
+namespace instrument {
+
+enum CounterID {
+	C_BytesLexed,
+	C_Arenas,
+	C_ArenaAllocations,  // ASTArena::make and copy
+	C_ArenaBytes,
+	// one per ExprAST::ExprKind, in the same order
+	C_NumberExprs,
+	C_VariableExprs,
+	C_BinaryExprs,
+	C_CallExprs,
+	C_Prototypes,
+	C_Functions,
+	C_IRInstructions,  // in the modules handed to the JIT, once optimized
+	C_ObjectCacheHits,
+	C_ObjectCacheMisses,
+	C_LazyDefinitions,  // generated on their first call, with -lazy
+	C_BatchChunks,  // run by a BatchExecutor
+	C_BatchSteals,
+	C_ExprsFolded,  // by the Simplifier, into a number or an operand
+	C_ExprsShared,  // replaced by an identical node, by the Simplifier
+	NumCounters
+};
+
+enum TimerID {
+	T_Gettok,
+	T_ParseExpression,
+	T_HandleDefinition,
+	T_HandleExtern,
+	T_HandleTopLevelExpression,
+	T_Codegen,
+	T_Optimize,  // the whole pass pipeline over a module
+	// the passes of the pipeline, each time one runs
+	T_PassInstCombine,
+	T_PassReassociate,
+	T_PassGVN,
+	T_PassSimplifyCFG,
+	T_PassInliner,
+	T_JITCompile,  // native code generation, on the first lookup
+	NumTimers
+};
+
+enum ReportFormat { RF_JSON, RF_ChromeTrace };
+
+// the lowest Token kind; token kinds run from here to 255
+static const int MinToken = -6;
+static const unsigned NumTokenKinds = 256 - MinToken;
+
+inline const char* getCounterName(CounterID C) {
+	static const char* const Names[NumCounters] = {
+		"bytes_lexed", "arenas", "arena_allocations", "arena_bytes",
+		"NumberExprAST", "VariableExprAST", "BinaryExprAST", "CallExprAST",
+		"PrototypeAST", "FunctionAST", "ir_instructions", "object_cache_hits",
+		"object_cache_misses", "lazy_definitions", "batch_chunks",
+		"batch_steals", "exprs_folded", "exprs_shared"
+	};
+	return Names[C];
+}
+
+inline const char* getTimerName(TimerID T) {
+	static const char* const Names[NumTimers] = {
+		"gettok", "ParseExpression", "HandleDefinition", "HandleExtern",
+		"HandleTopLevelExpression", "codegen", "optimize", "InstCombinePass",
+		"ReassociatePass", "GVNPass", "SimplifyCFGPass", "InlinerPass",
+		"jit_compile"
+	};
+	return Names[T];
+}
+
+// the part of the compiler T is in, for the trace
+inline const char* getTimerCategory(TimerID T) {
+	return T < T_Codegen ? "frontend" : "jit";
+}
+
+// the name of a token kind: a Token's enumerator, or the character
+inline void printTokenName(llvm::raw_ostream& OS, int Tok) {
+	static const char* const Names[] = {
+		"tok_eof", "tok_def", "tok_extern", "tok_identifier", "tok_number",
+		"tok_error"
+	};
+	if (Tok < 0)
+		OS << Names[-Tok - 1];
+	else if (Tok > ' ' && Tok < 127 && Tok != '"' && Tok != '\\')
+		OS << '\'' << char(Tok) << '\'';
+	else
+		OS << llvm::format("0x%02x", Tok);
+}
+
+#ifdef KS_INSTRUMENT
+
+static const bool Enabled = true;
+
+// a timed region, for the trace
+struct TraceEvent {
+	TimerID Timer;
+	uint64_t Start, Duration;  // nanoseconds since the epoch
+};
+
+// what one thread has counted
+struct ThreadStats {
+	unsigned ThreadIndex = 0;
+	uint64_t Counters[NumCounters] = {};
+	uint64_t Tokens[NumTokenKinds] = {};
+	uint64_t TimerCalls[NumTimers] = {};
+	uint64_t TimerNanos[NumTimers] = {};
+	unsigned Depth[NumTimers] = {};  // how many of each timer are running
+	std::vector<TraceEvent> Events;
+	uint64_t DroppedEvents = 0;
+};
+
+// per thread, so a long run's trace stays a manageable size
+static const size_t MaxTraceEvents = 1 << 20;
+
+inline uint64_t now() {
+	static const std::chrono::steady_clock::time_point Epoch =
+		std::chrono::steady_clock::now();
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - Epoch).count();
+}
+
+// every thread's stats, kept after the thread exits for the report
+struct Registry {
+	std::mutex Lock;
+	std::vector<std::unique_ptr<ThreadStats>> Threads;
+};
+
+inline Registry& getRegistry() {
+	static Registry R;
+	return R;
+}
+
+inline ThreadStats& getThreadStats() {
+	static thread_local ThreadStats* Stats = nullptr;
+	if (!Stats) {
+		Registry& R = getRegistry();
+		std::lock_guard<std::mutex> L(R.Lock);
+		R.Threads.emplace_back(new ThreadStats());
+		Stats = R.Threads.back().get();
+		Stats->ThreadIndex = R.Threads.size() - 1;
+	}
+	return *Stats;
+}
+
+inline void count(CounterID C, uint64_t N = 1) {
+	getThreadStats().Counters[C] += N;
+}
+
+inline void countToken(int Tok) {
+	getThreadStats().Tokens[Tok - MinToken] += 1;
+}
+
+// ScopedTimer -- times the scope it lives in. Only the outermost of nested
+// timers with the same ID counts, so a recursive function is timed once
+// per call from outside. gettok() is too frequent to trace and is only
+// totalled.
+class ScopedTimer {
+	TimerID ID;
+	bool Outermost;
+	uint64_t Start;
+
+	public:
+	explicit ScopedTimer(TimerID ID)
+		: ID(ID), Outermost(getThreadStats().Depth[ID]++ == 0), Start(now()) {}
+	~ScopedTimer() {
+		uint64_t End = now();
+		ThreadStats& S = getThreadStats();
+		--S.Depth[ID];
+		if (!Outermost)
+			return;
+		++S.TimerCalls[ID];
+		S.TimerNanos[ID] += End - Start;
+		if (ID == T_Gettok)
+			return;
+		if (S.Events.size() < MaxTraceEvents)
+			S.Events.push_back(TraceEvent{ID, Start, End - Start});
+		else
+			++S.DroppedEvents;
+	}
+	ScopedTimer(const ScopedTimer&) = delete;
+	ScopedTimer& operator=(const ScopedTimer&) = delete;
+};
+
+// the sum over every thread so far
+inline ThreadStats getTotals() {
+	ThreadStats Total;
+	Registry& R = getRegistry();
+	std::lock_guard<std::mutex> L(R.Lock);
+	for (const auto& S : R.Threads) {
+		for (unsigned I = 0; I != NumCounters; ++I)
+			Total.Counters[I] += S->Counters[I];
+		for (unsigned I = 0; I != NumTokenKinds; ++I)
+			Total.Tokens[I] += S->Tokens[I];
+		for (unsigned I = 0; I != NumTimers; ++I) {
+			Total.TimerCalls[I] += S->TimerCalls[I];
+			Total.TimerNanos[I] += S->TimerNanos[I];
+		}
+		Total.DroppedEvents += S->DroppedEvents;
+	}
+	return Total;
+}
+
+// the tokens seen, by kind, as the members of a JSON object
+inline void writeTokenCounts(llvm::raw_ostream& OS, const ThreadStats& T) {
+	bool First = true;
+	for (unsigned I = 0; I != NumTokenKinds; ++I) {
+		if (!T.Tokens[I])
+			continue;
+		OS << (First ? "" : ", ") << '"';
+		printTokenName(OS, int(I) + MinToken);
+		OS << "\": " << T.Tokens[I];
+		First = false;
+	}
+}
+
+inline void writeJSON(llvm::raw_ostream& OS) {
+	ThreadStats T = getTotals();
+	OS << "{\n  \"counters\": {";
+	for (unsigned I = 0; I != NumCounters; ++I)
+		OS << (I ? ", " : "") << '"' << getCounterName(CounterID(I)) << "\": "
+			<< T.Counters[I];
+	OS << "},\n  \"tokens\": {";
+	writeTokenCounts(OS, T);
+	OS << "},\n  \"timers\": {";
+	for (unsigned I = 0; I != NumTimers; ++I)
+		OS << (I ? "," : "") << "\n    \"" << getTimerName(TimerID(I))
+			<< "\": {\"calls\": " << T.TimerCalls[I] << ", \"seconds\": "
+			<< llvm::format("%.9f", T.TimerNanos[I] / 1e9) << '}';
+	OS << "\n  }\n}\n";
+}
+
+inline void writeChromeTrace(llvm::raw_ostream& OS) {
+	ThreadStats T = getTotals();
+	uint64_t End = now();
+	OS << "{\"traceEvents\": [\n";
+	{
+		Registry& R = getRegistry();
+		std::lock_guard<std::mutex> L(R.Lock);
+		for (const auto& S : R.Threads)
+			for (const TraceEvent& E : S->Events)
+				OS << "{\"name\": \"" << getTimerName(E.Timer)
+					<< "\", \"cat\": \"" << getTimerCategory(E.Timer)
+					<< "\", \"ph\": \"X\", \"pid\": 1, "
+					<< "\"tid\": " << S->ThreadIndex << ", \"ts\": "
+					<< llvm::format("%.3f", E.Start / 1e3) << ", \"dur\": "
+					<< llvm::format("%.3f", E.Duration / 1e3) << "},\n";
+	}
+	// the totals, as counter events at the end of the trace
+	OS << "{\"name\": \"counters\", \"ph\": \"C\", \"pid\": 1, \"ts\": "
+		<< llvm::format("%.3f", End / 1e3) << ", \"args\": {";
+	for (unsigned I = 0; I != NumCounters; ++I)
+		OS << (I ? ", " : "") << '"' << getCounterName(CounterID(I)) << "\": "
+			<< T.Counters[I];
+	OS << "}},\n{\"name\": \"tokens\", \"ph\": \"C\", \"pid\": 1, \"ts\": "
+		<< llvm::format("%.3f", End / 1e3) << ", \"args\": {";
+	writeTokenCounts(OS, T);
+	OS << "}}\n], \"displayTimeUnit\": \"ns\", \"otherData\": "
+		<< "{\"dropped_events\": \"" << T.DroppedEvents << "\"}}\n";
+}
+
+inline void writeReport(llvm::raw_ostream& OS, ReportFormat Format) {
+	if (Format == RF_ChromeTrace)
+		writeChromeTrace(OS);
+	else
+		writeJSON(OS);
+}
+
+#else
+
+static const bool Enabled = false;
+
+inline void count(CounterID, uint64_t = 1) {}
+inline void countToken(int) {}
+
+class ScopedTimer {
+	public:
+	explicit ScopedTimer(TimerID) {}
+};
+
+inline void writeReport(llvm::raw_ostream&, ReportFormat) {}
+
+#endif
+
+} // namespace instrument
+
+#endif
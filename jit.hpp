@@ -0,0 +1,342 @@
+#ifndef KALEIDOSCOPE_JIT_HPP
+#define KALEIDOSCOPE_JIT_HPP
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CodeGen.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Target/TargetMachine.h"
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+// JIT
+
+// KaleidoscopeJIT -- compiles modules to native code in this process, on
+// an ORC LLJIT. Every module goes into the same JITDylib, so a function
+// defined in one module can be called from the next. Names no module
+// defines, and that are not host functions given to addHostFunction(), are
+// looked up in the process itself, which is how an extern such as sin()
+// finds the C library's.
+//
+// A module is compiled when one of its functions is first looked up. With
+// compile threads, modules are compiled on those, as many at once as there
+// are threads, and compile() looks up a whole batch of functions at once to
+// make use of them. Calls from one module to another go through the JIT's
+// symbol table by name, however, and in whichever order they are compiled.
+//
+// A lazy function, added by addLazyFunction(), is lazier still: the main
+// JITDylib only has a stub for it, and nothing is generated until the stub
+// is first called. Its module then goes into a JITDylib of its own, which
+// links against the main one, so that the functions it calls are still
+// generated only when they are called in turn, through their stubs.
+
+// LazyFunctionUnit -- a function whose module is generated only once it is
+// looked up: on a compile thread, if there are any
+class LazyFunctionUnit : public llvm::orc::MaterializationUnit {
+	public:
+	using GeneratorFn = std::function<llvm::orc::ThreadSafeModule()>;
+
+	private:
+	llvm::orc::IRLayer& Layer;
+	GeneratorFn Generate;
+
+	static Interface getInterface(llvm::orc::SymbolStringPtr Name,
+			llvm::JITSymbolFlags Flags) {
+		llvm::orc::SymbolFlagsMap Symbols;
+		Symbols[std::move(Name)] = Flags;
+		return Interface(std::move(Symbols), nullptr);
+	}
+
+	void discard(const llvm::orc::JITDylib&,
+			const llvm::orc::SymbolStringPtr&) override {}
+
+	public:
+	// Name, whose module Generate returns, to be compiled by Layer
+	LazyFunctionUnit(llvm::orc::IRLayer& Layer, llvm::orc::SymbolStringPtr Name,
+			llvm::JITSymbolFlags Flags, GeneratorFn Generate)
+		: MaterializationUnit(getInterface(std::move(Name), Flags)), Layer(Layer),
+			Generate(std::move(Generate)) {}
+
+	llvm::StringRef getName() const override { return "LazyFunctionUnit"; }
+
+	void materialize(
+			std::unique_ptr<llvm::orc::MaterializationResponsibility> R) override {
+		Layer.emit(std::move(R), Generate());
+	}
+};
+
+// PerThreadCompiler -- compiles modules on any number of threads at once,
+// each with a target machine of its own, made the first time it compiles.
+// (ORC's ConcurrentIRCompiler makes one for every module, which costs more
+// than compiling a small one.)
+class PerThreadCompiler : public llvm::orc::IRCompileLayer::IRCompiler {
+	llvm::orc::JITTargetMachineBuilder JTMB;
+	llvm::ObjectCache* Cache;
+	std::mutex Lock;
+	std::map<std::thread::id, std::unique_ptr<llvm::TargetMachine>> Machines;
+
+	public:
+	PerThreadCompiler(llvm::orc::JITTargetMachineBuilder JTMB,
+			llvm::ObjectCache* Cache)
+		: IRCompiler(llvm::orc::irManglingOptionsFromTargetOptions(
+				JTMB.getOptions())), JTMB(std::move(JTMB)), Cache(Cache) {}
+
+	llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> operator()(
+			llvm::Module& M) override {
+		llvm::TargetMachine* TM;
+		{
+			std::lock_guard<std::mutex> L(Lock);
+			std::unique_ptr<llvm::TargetMachine>& Mine =
+				Machines[std::this_thread::get_id()];
+			if (!Mine) {
+				auto NewTM = JTMB.createTargetMachine();
+				if (!NewTM)
+					return NewTM.takeError();
+				Mine = std::move(*NewTM);
+			}
+			TM = Mine.get();
+		}
+		return llvm::orc::SimpleCompiler(*TM, Cache)(M);
+	}
+};
+
+class KaleidoscopeJIT {
+	// the compile threads, if any; they outlive J, which gives them work
+	std::unique_ptr<llvm::ThreadPool> CompileThreads;
+	std::unique_ptr<llvm::orc::LLJIT> J;
+	// where the stubs of lazy functions go when first called
+	std::unique_ptr<llvm::orc::LazyCallThroughManager> LazyCalls;
+	std::unique_ptr<llvm::orc::IndirectStubsManager> Stubs;
+	// the lazy functions' own modules
+	llvm::orc::JITDylib* LazyDylib;
+
+	KaleidoscopeJIT(std::unique_ptr<llvm::ThreadPool> CompileThreads,
+			std::unique_ptr<llvm::orc::LLJIT> J,
+			std::unique_ptr<llvm::orc::LazyCallThroughManager> LazyCalls)
+		: CompileThreads(std::move(CompileThreads)), J(std::move(J)),
+			LazyCalls(std::move(LazyCalls)),
+			Stubs(llvm::orc::createLocalIndirectStubsManagerBuilder(
+				this->J->getTargetTriple())()),
+			LazyDylib(&this->J->getExecutionSession().createBareJITDylib(
+				"<lazy>")) {
+		LazyDylib->setLinkOrder({{&this->J->getMainJITDylib(),
+			llvm::orc::JITDylibLookupFlags::MatchExportedSymbolsOnly}},
+			/*LinkAgainstThisJITDylibFirst=*/false);
+	}
+
+	// wait until the compile threads have nothing left to do. A lookup
+	// returns once its symbols are ready, which may be before the thread
+	// that compiled them has finished with their module: removing the
+	// module then would pull it from under that thread.
+	void waitForCompileThreads() {
+		if (CompileThreads)
+			CompileThreads->wait();
+	}
+
+	// what a call to a lazy function returns when it cannot be compiled;
+	// the JIT has reported why
+	static double lazyCallFailed() {
+		return std::numeric_limits<double>::quiet_NaN();
+	}
+
+	public:
+	~KaleidoscopeJIT() { waitForCompileThreads(); }
+
+	// set up the host target, which create() compiles for; once per process
+	static void initializeNativeTarget() {
+		llvm::InitializeNativeTarget();
+		llvm::InitializeNativeTargetAsmPrinter();
+		llvm::InitializeNativeTargetAsmParser();
+	}
+
+	// what the JIT makes the target machines it compiles with from
+	static llvm::Expected<llvm::orc::JITTargetMachineBuilder>
+	getTargetMachineBuilder(llvm::CodeGenOpt::Level OptLevel) {
+		auto JTMB = llvm::orc::JITTargetMachineBuilder::detectHost();
+		if (JTMB)
+			JTMB->setCodeGenOptLevel(OptLevel);
+		return JTMB;
+	}
+
+	// a target machine like those a JIT made at OptLevel compiles with, e.g.
+	// for the optimizer
+	static llvm::Expected<std::unique_ptr<llvm::TargetMachine>>
+	createTargetMachine(llvm::CodeGenOpt::Level OptLevel) {
+		auto JTMB = getTargetMachineBuilder(OptLevel);
+		if (!JTMB)
+			return JTMB.takeError();
+		return JTMB->createTargetMachine();
+	}
+
+	// a JIT whose code generator works at OptLevel, on CompileThreads
+	// threads or, if 0, on the thread that looks a function up, and keeps
+	// the object code it compiles in Cache, if there is one
+	static llvm::Expected<std::unique_ptr<KaleidoscopeJIT>> create(
+			llvm::CodeGenOpt::Level OptLevel = llvm::CodeGenOpt::Default,
+			llvm::ObjectCache* Cache = nullptr, unsigned CompileThreads = 0) {
+		auto JTMB = getTargetMachineBuilder(OptLevel);
+		if (!JTMB)
+			return JTMB.takeError();
+
+		llvm::orc::LLJITBuilder Builder;
+		Builder.setJITTargetMachineBuilder(std::move(*JTMB));
+		if (Cache || CompileThreads)
+			Builder.setCompileFunctionCreator(
+				[Cache, CompileThreads](llvm::orc::JITTargetMachineBuilder JTMB)
+					-> llvm::Expected<std::unique_ptr<
+						llvm::orc::IRCompileLayer::IRCompiler>> {
+					if (CompileThreads)
+						return std::make_unique<PerThreadCompiler>(std::move(JTMB),
+							Cache);
+					auto TM = JTMB.createTargetMachine();
+					if (!TM)
+						return TM.takeError();
+					return std::make_unique<llvm::orc::TMOwningSimpleCompiler>(
+						std::move(*TM), Cache);
+				});
+		auto J = Builder.create();
+		if (!J)
+			return J.takeError();
+		auto Process = llvm::orc::DynamicLibrarySearchGenerator::
+			GetForCurrentProcess((*J)->getDataLayout().getGlobalPrefix());
+		if (!Process)
+			return Process.takeError();
+		(*J)->getMainJITDylib().addGenerator(std::move(*Process));
+		auto LazyCalls = llvm::orc::createLocalLazyCallThroughManager(
+			(*J)->getTargetTriple(), (*J)->getExecutionSession(),
+			llvm::pointerToJITTargetAddress(&lazyCallFailed));
+		if (!LazyCalls)
+			return LazyCalls.takeError();
+		// LLJIT would make its own threads, but not wait for them
+		std::unique_ptr<llvm::ThreadPool> Threads;
+		if (CompileThreads) {
+			Threads = std::make_unique<llvm::ThreadPool>(
+				llvm::hardware_concurrency(CompileThreads));
+			llvm::ThreadPool* Pool = Threads.get();
+			(*J)->getExecutionSession().setDispatchTask(
+				[Pool](std::unique_ptr<llvm::orc::Task> T) {
+					std::shared_ptr<llvm::orc::Task> Shared(std::move(T));
+					Pool->async([Shared] { Shared->run(); });
+				});
+		}
+		return std::unique_ptr<KaleidoscopeJIT>(new KaleidoscopeJIT(
+			std::move(Threads), std::move(*J), std::move(*LazyCalls)));
+	}
+
+	// what the modules should be generated for
+	const llvm::DataLayout& getDataLayout() const { return J->getDataLayout(); }
+
+	// a tracker for modules that are to be removed again together
+	llvm::orc::ResourceTrackerSP createResourceTracker() {
+		return J->getMainJITDylib().createResourceTracker();
+	}
+
+	// add M, for good, or until RT is removed
+	llvm::Error addModule(llvm::orc::ThreadSafeModule M,
+			llvm::orc::ResourceTrackerSP RT = nullptr) {
+		if (!RT)
+			RT = J->getMainJITDylib().getDefaultResourceTracker();
+		return J->addIRModule(RT, std::move(M));
+	}
+
+	// define Name as the host function at Address, for calls to it to call
+	llvm::Error addHostFunction(llvm::StringRef Name,
+			llvm::JITTargetAddress Address) {
+		llvm::orc::SymbolMap Symbols;
+		Symbols[J->mangleAndIntern(Name)] = llvm::JITEvaluatedSymbol(Address,
+			llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable);
+		return J->getMainJITDylib().define(
+			llvm::orc::absoluteSymbols(std::move(Symbols)));
+	}
+
+	// add the function Name, which Generate returns a module defining when
+	// Name is first looked up
+	llvm::Error addFunction(llvm::StringRef Name,
+			LazyFunctionUnit::GeneratorFn Generate) {
+		return J->getMainJITDylib().define(std::make_unique<LazyFunctionUnit>(
+			J->getIRCompileLayer(), J->mangleAndIntern(Name),
+			llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable,
+			std::move(Generate)));
+	}
+
+	// add a stub for the function Name, which Generate returns a module
+	// defining when the stub is first called
+	llvm::Error addLazyFunction(llvm::StringRef Name,
+			LazyFunctionUnit::GeneratorFn Generate) {
+		llvm::orc::SymbolStringPtr Sym = J->mangleAndIntern(Name);
+		llvm::JITSymbolFlags Flags =
+			llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable;
+		if (auto Err = LazyDylib->define(std::make_unique<LazyFunctionUnit>(
+				J->getIRCompileLayer(), Sym, Flags, std::move(Generate))))
+			return Err;
+		llvm::orc::SymbolAliasMap Alias;
+		Alias[Sym] = llvm::orc::SymbolAliasMapEntry(Sym, Flags);
+		return J->getMainJITDylib().define(llvm::orc::lazyReexports(*LazyCalls,
+			*Stubs, *LazyDylib, std::move(Alias)));
+	}
+
+	// the address of the function Name, compiling it (and what it calls)
+	// first if it has not been yet
+	llvm::Expected<llvm::JITTargetAddress> lookup(llvm::StringRef Name) {
+		auto Sym = J->lookup(Name);
+		waitForCompileThreads();
+		if (!Sym)
+			return Sym.takeError();
+		return Sym->getAddress();
+	}
+
+	// compile the functions Names, all at once, and wait until each is
+	// either ready to call or has failed
+	llvm::Error compile(llvm::ArrayRef<llvm::StringRef> Names) {
+		// one lookup each, so that none returns early for another's error
+		// while that one is still being compiled
+		std::mutex Lock;
+		std::condition_variable Finished;
+		size_t Remaining = Names.size();
+		llvm::Error Errors = llvm::Error::success();
+		for (llvm::StringRef Name : Names)
+			J->getExecutionSession().lookup(llvm::orc::LookupKind::Static,
+				llvm::orc::makeJITDylibSearchOrder(&J->getMainJITDylib()),
+				llvm::orc::SymbolLookupSet(J->mangleAndIntern(Name)),
+				llvm::orc::SymbolState::Ready,
+				[&](llvm::Expected<llvm::orc::SymbolMap> Result) {
+					std::lock_guard<std::mutex> L(Lock);
+					if (!Result)
+						Errors = llvm::joinErrors(std::move(Errors),
+							Result.takeError());
+					if (--Remaining == 0)
+						Finished.notify_all();
+				},
+				llvm::orc::NoDependenciesToRegister);
+		std::unique_lock<std::mutex> L(Lock);
+		Finished.wait(L, [&] { return Remaining == 0; });
+		waitForCompileThreads();
+		return Errors;
+	}
+};
+
+#endif
@@ -0,0 +1,295 @@
+#ifndef KALEIDOSCOPE_LEXER_HPP
+#define KALEIDOSCOPE_LEXER_HPP
+
+#include "diagnostics.hpp"
+#include "instrument.hpp"
+#include "number.hpp"
+#include "scan.hpp"
+#include "source_buffer.hpp"
+#include "symbol_table.hpp"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//  lexer
+enum Token {
+	tok_eof = -1,
+	tok_def = -2,
+	tok_extern = -3,
+	tok_identifier = -4,
+	tok_number = -5,
+	tok_error = -6  // a malformed token; the lexer has reported it
+};
+static_assert(tok_error == instrument::MinToken,
+	"instrument counts tokens from the lowest Token kind up");
+
+// a token's spelling, as an (offset, length) view into the source buffer.
+// Offsets rather than pointers, because a streamed buffer may move when
+// it is refilled.
+struct TokenText {
+	uint32_t Offset;
+	uint32_t Length;
+};
+
+// character classes for the lexer, one table load per byte
+enum : uint8_t {
+	CC_Other = 0,
+	CC_Space = 1 << 0,  // ' ', \t, \n, \v, \f, \r
+	CC_Alpha = 1 << 1,  // [a-zA-Z]
+	CC_Digit = 1 << 2,  // [0-9]
+	CC_Dot = 1 << 3,  // '.'
+	CC_Hash = 1 << 4,  // '#'
+	CC_Nul = 1 << 5  // '\0', also the sentinel after the buffer
+};
+
+static constexpr uint8_t classifyChar(unsigned C) {
+	return C == ' ' || (C >= '\t' && C <= '\r') ? CC_Space
+		: (C | 0x20) >= 'a' && (C | 0x20) <= 'z' ? CC_Alpha
+		: C >= '0' && C <= '9' ? CC_Digit
+		: C == '.' ? CC_Dot
+		: C == '#' ? CC_Hash
+		: C == 0 ? CC_Nul
+		: CC_Other;
+}
+
+#define CC_ROW4(N) classifyChar(N), classifyChar(N + 1), classifyChar(N + 2), \
+	classifyChar(N + 3)
+#define CC_ROW16(N) CC_ROW4(N), CC_ROW4(N + 4), CC_ROW4(N + 8), CC_ROW4(N + 12)
+#define CC_ROW64(N) CC_ROW16(N), CC_ROW16(N + 16), CC_ROW16(N + 32), \
+	CC_ROW16(N + 48)
+static constexpr uint8_t CharClass[256] = {
+	CC_ROW64(0), CC_ROW64(64), CC_ROW64(128), CC_ROW64(192)
+};
+#undef CC_ROW64
+#undef CC_ROW16
+#undef CC_ROW4
+
+inline uint8_t charClass(const char* P) {
+	return CharClass[(unsigned char)*P];
+}
+
+static_assert(SourceBuffer::Padding >= ScanOverread,
+	"the scan kernels may read past the end of the source");
+
+inline const char* findNonNumberChar(const char* P) {
+	while (charClass(P) & (CC_Digit | CC_Dot))
+		++P;
+	return P;
+}
+
+// TokenBuffer -- the whole input, lexed ahead of the parser, as a
+// structure of arrays. Token I has kind Kind[I] (a Token, or a character)
+// and starts at Offset[I]. Value[I] is its SymbolID for a tok_identifier,
+// or its index in Numbers for a tok_number. The last token is tok_eof.
+//
+// A TokenBuffer can also hold one block of a token stream, which need not
+// end in tok_eof. Either way, the lexer's error for each tok_error is kept
+// in Errors, at index Value[I], for the parser to report when it gets
+// there, so that errors come out in the same order as from a parser that
+// lexes as it goes. The error is kept rendered, as the source it quotes
+// may be gone by then.
+struct LexError {
+	Diagnostic Diag;
+	std::string Text;
+};
+
+struct TokenBuffer {
+	std::vector<int16_t> Kind;
+	std::vector<uint32_t> Offset;
+	std::vector<uint32_t> Value;
+	std::vector<double> Numbers;
+	std::vector<LexError> Errors;
+
+	size_t size() const { return Kind.size(); }
+	bool empty() const { return Kind.empty(); }
+
+	void clear() {
+		Kind.clear();
+		Offset.clear();
+		Value.clear();
+		Numbers.clear();
+		Errors.clear();
+	}
+
+	void push(int Tok, uint32_t Off, uint32_t Val) {
+		Kind.push_back(Tok);
+		Offset.push_back(Off);
+		Value.push_back(Val);
+	}
+};
+
+// Lexer -- turns a SourceBuffer into tokens. All of the lexing state lives
+// here, so lexers over different sources can run on different threads, as
+// long as they don't share a SymbolTable.
+class Lexer {
+	SourceBuffer& Source;
+	SymbolTable& Symbols;  // every identifier is interned as it is lexed
+	DiagnosticEngine& Diags;  // where lexical errors are reported
+	// in lexAll(), where they are kept instead, rendered by Diags
+	std::vector<LexError>* KeptErrors = nullptr;
+
+	const char* CurPtr;  // the lexer's position in Source
+	uint32_t TokOffset = 0;  // where the last token starts
+	TokenText IdentifierText = {0, 0};  // filled in if tok_identifier
+	SymbolID IdentifierSym = 0;  // filled in if tok_identifier
+	double NumVal = 0;  // filled in if tok_number
+
+	// advance P over a run of characters with one of the scan kernels,
+	// reading more input when the run reaches the end of the buffer. InToken
+	// says the run is part of the token at TokOffset, which must be kept.
+	template <const char* Scan(const char*)>
+	void skipChars(const char*& P, bool InToken = false) {
+		while (true) {
+			P = Scan(P);
+			if (P != Source.end() ||
+					!Source.refill(P, InToken ? Source.at(TokOffset) : P))
+				return;
+		}
+	}
+
+	// skip the body of a '#' comment, up to the end of the line
+	void skipComment(const char*& P) {
+		while (true) {
+			skipChars<findEndOfLine>(P);
+			if (*P != 0 || P == Source.end())
+				return;
+			++P; // a NUL inside the comment
+		}
+	}
+
+	public:
+	Lexer(SourceBuffer& Source, SymbolTable& Symbols, DiagnosticEngine& Diags)
+		: Source(Source), Symbols(Symbols), Diags(Diags), CurPtr(Source.begin()) {}
+
+	// continue lexing at Offset, which must be where a token (or the
+	// whitespace or comment before one) starts
+	void seek(uint32_t Offset) { CurPtr = Source.at(Offset); }
+
+	SourceBuffer& getSource() const { return Source; }
+	SymbolTable& getSymbols() const { return Symbols; }
+	uint32_t getTokOffset() const { return TokOffset; }
+	TokenText getIdentifierText() const { return IdentifierText; }
+	SymbolID getIdentifierSym() const { return IdentifierSym; }
+	double getNumVal() const { return NumVal; }
+
+	llvm::StringRef getTokenText(TokenText T) const {
+		return llvm::StringRef(Source.at(T.Offset), T.Length);
+	}
+
+	// return the next token from the source buffer
+	int gettok() {
+		if (!instrument::Enabled)
+			return lexToken();
+		instrument::ScopedTimer Timer(instrument::T_Gettok);
+		uint32_t Begin = Source.offsetOf(CurPtr);
+		int Tok = lexToken();
+		instrument::countToken(Tok);
+		instrument::count(instrument::C_BytesLexed,
+			Source.offsetOf(CurPtr) - Begin);
+		return Tok;
+	}
+
+	private:
+	void error(DiagID ID, uint32_t Offset, uint32_t Length) {
+		if (!KeptErrors) {
+			Diags.report(ID, Offset, Length);
+			return;
+		}
+		Diagnostic D{ID, Offset, Length};
+		std::string Text;
+		llvm::raw_string_ostream OS(Text);
+		Diags.render(OS, D);
+		KeptErrors->push_back(LexError{D, std::move(OS.str())});
+	}
+
+	int lexToken() {
+		const char* P = CurPtr;
+		while (true) {
+			switch (charClass(P)) {
+			case CC_Space: // skip any whitespace
+				skipChars<findNonSpace>(P);
+				continue;
+
+			case CC_Hash: // comment until end of line
+				++P;
+				skipComment(P);
+				continue;
+
+			case CC_Alpha: { // identifier: [a-zA-Z][a-zA-Z0-9]*
+				TokOffset = Source.offsetOf(P);
+				skipChars<findNonIdentChar>(P, true);
+				CurPtr = P;
+				IdentifierText = TokenText{TokOffset,
+					Source.offsetOf(P) - TokOffset};
+				IdentifierSym = Symbols.intern(getTokenText(IdentifierText));
+
+				if (IdentifierSym == sym_def)
+					return tok_def;
+				if (IdentifierSym == sym_extern)
+					return tok_extern;
+				return tok_identifier;
+			}
+
+			case CC_Digit:
+			case CC_Dot: { // Number: [0-9.]+
+				TokOffset = Source.offsetOf(P);
+				skipChars<findNonNumberChar>(P, true);
+				CurPtr = P;
+				const char* Begin = Source.at(TokOffset);
+				if (!parseNumber(Begin, P, NumVal)) {
+					error(err_invalid_number, TokOffset, P - Begin);
+					return tok_error;
+				}
+				return tok_number;
+			}
+
+			case CC_Nul:
+				// check for end of file. Don't eat the EOF.
+				if (P == Source.end()) {
+					if (Source.refill(P))
+						continue;
+					CurPtr = P;
+					TokOffset = Source.offsetOf(P);
+					return tok_eof;
+				}
+				break; // a NUL inside the input is just another character
+			}
+
+			// otherwise just return the character as its ascii value
+			TokOffset = Source.offsetOf(P);
+			CurPtr = P + 1;
+			return (unsigned char)*P;
+		}
+	}
+
+	public:
+	// run gettok() over the rest of the input, keeping its errors in Toks
+	void lexAll(TokenBuffer& Toks) {
+		// a guess at the token density, to keep reallocation out of the loop
+		size_t Guess = (Source.end() - CurPtr) / 4;
+		Toks.Kind.reserve(Guess);
+		Toks.Offset.reserve(Guess);
+		Toks.Value.reserve(Guess);
+
+		KeptErrors = &Toks.Errors;
+		int Tok;
+		do {
+			Tok = gettok();
+			uint32_t Val = 0;
+			if (Tok == tok_identifier)
+				Val = IdentifierSym;
+			else if (Tok == tok_number) {
+				Val = Toks.Numbers.size();
+				Toks.Numbers.push_back(NumVal);
+			}
+			else if (Tok == tok_error)
+				Val = Toks.Errors.size() - 1;
+			Toks.push(Tok, TokOffset, Val);
+		} while (Tok != tok_eof);
+		KeptErrors = nullptr;
+	}
+};
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef KALEIDOSCOPE_MEMORY_USAGE_HPP
+#define KALEIDOSCOPE_MEMORY_USAGE_HPP
+
+#include <cstddef>
+#include <cstdio>
+#include <sys/resource.h>
+
+// Memory usage
+//
+// The process's resident set size, for the benchmark and stress drivers,
+// from /proc/self where there is one, and getrusage() otherwise.
+
+// the value of Field, in kB, in /proc/self/status; 0 if there is none
+inline size_t getStatusKB(const char* Field) {
+	size_t KB = 0;
+	if (FILE* F = fopen("/proc/self/status", "r")) {
+		char Line[256];
+		while (fgets(Line, sizeof(Line), F))
+			if (sscanf(Line, Field, &KB) == 1)
+				break;
+		fclose(F);
+	}
+	return KB;
+}
+
+// peak resident set size, in bytes, since the last resetPeakRSS(). Where
+// the peak can't be reset, it is the peak for the whole run so far.
+inline void resetPeakRSS() {
+	if (FILE* F = fopen("/proc/self/clear_refs", "w")) {
+		fputs("5", F);
+		fclose(F);
+	}
+}
+
+inline size_t getPeakRSS() {
+	if (size_t KB = getStatusKB("VmHWM: %zu kB"))
+		return KB * 1024;
+	struct rusage Usage;
+	getrusage(RUSAGE_SELF, &Usage);
+	return size_t(Usage.ru_maxrss) * 1024;
+}
+
+// the resident set size now, in bytes, or 0 where it isn't known
+inline size_t getCurrentRSS() {
+	return getStatusKB("VmRSS: %zu kB") * 1024;
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef KALEIDOSCOPE_NUMBER_HPP
+#define KALEIDOSCOPE_NUMBER_HPP
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include <cstdint>
+#include <cstdlib>
+
+// parseNumber -- convert a number literal, [0-9]+ ('.' [0-9]*)? or
+// '.' [0-9]+, to the nearest double. Returns false if [Begin, End) is not
+// exactly one such literal (e.g. "1.2.3" or ".").
+//
+// Literals with at most 19 significant digits whose value is an integer
+// below 2^53 times or divided by a power of ten up to 10^22 -- which is
+// nearly every constant anyone writes -- are converted with a single
+// IEEE multiply or divide. Both operands are then exact, so the result is
+// correctly rounded (Clinger's fast path, as in fast_float). Anything
+// else goes to strtod, which is also correctly rounded, from a stack copy.
+inline bool parseNumber(const char* Begin, const char* End, double& Val) {
+	static const double Pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	const int MaxDigits = 19;  // always fits in a uint64_t
+
+	uint64_t Mantissa = 0;  // the significant digits, leading zeros dropped
+	int Digits = 0;  // number of digits in Mantissa
+	int Exp10 = 0;  // value == Mantissa * 10^Exp10, if nothing was dropped
+	bool SeenDot = false, SeenDigit = false, Inexact = false;
+
+	for (const char* P = Begin; P != End; ++P) {
+		if (*P == '.') {
+			if (SeenDot)
+				return false;
+			SeenDot = true;
+			continue;
+		}
+		unsigned D = *P - '0';
+		if (D > 9)
+			return false;
+		SeenDigit = true;
+		if (Mantissa == 0 && D == 0) {
+			Exp10 -= SeenDot;
+			continue;
+		}
+		if (Digits < MaxDigits) {
+			Mantissa = Mantissa * 10 + D;
+			++Digits;
+			Exp10 -= SeenDot;
+		}
+		else {
+			// a dropped zero after the point changes nothing; a dropped
+			// integer digit scales the mantissa
+			Inexact |= D != 0;
+			Exp10 += !SeenDot;
+		}
+	}
+	if (!SeenDigit)
+		return false;
+
+	if (!Inexact && Mantissa <= uint64_t(1) << 53 && Exp10 >= -22 &&
+			Exp10 <= 22) {
+		double M = double(Mantissa);
+		Val = Exp10 < 0 ? M / Pow10[-Exp10] : M * Pow10[Exp10];
+		return true;
+	}
+
+	llvm::SmallString<64> Buf(llvm::StringRef(Begin, End - Begin));
+	Val = strtod(Buf.c_str(), nullptr);
+	return true;
+}
+
+#endif
@@ -0,0 +1,260 @@
+#ifndef KALEIDOSCOPE_OBJECT_CACHE_HPP
+#define KALEIDOSCOPE_OBJECT_CACHE_HPP
+
+#include "ast.hpp"
+#include "codegen.hpp"
+#include "instrument.hpp"
+#include "symbol_table.hpp"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Object cache
+//
+// The object code of JIT-compiled definitions, kept in a directory so
+// that a later run given the same definition loads it rather than
+// compiling it again. A definition's module is named after its key, and
+// its object file after the key too, <key>.o.
+//
+// The key is a hash of everything the object code depends on:
+//
+//   - the definition, normalized: names are spelled out, since SymbolIDs
+//     differ from run to run, arguments are numbered by position, so
+//     renaming one still hits, and numbers are compared bit for bit
+//   - what each function they call is bound to (see CalleeBinding), as a
+//     call to an intrinsic compiles to other code than a call by name
+//   - the same for each definition CodeGen imported into the module for
+//     the inliner, as their code may now be part of this one's
+//   - whether the AST was simplified: the key walks a simplified AST as a
+//     tree, but the code generator emits a subexpression it shares once
+//   - the optimization level, the target triple, CPU and features, the
+//     LLVM version, and the cache's own version, bumped whenever the IR
+//     the code generator emits changes
+//
+// Invalidation is by key alone: a changed body, a changed inlined callee,
+// a callee bound otherwise, another -simplify, -O level, host or LLVM
+// simply misses, and the stale file is left alone. Nothing else is
+// needed, because what the key leaves out is not in the object code: calls
+// that were not inlined, and externs, go through the JIT's symbol table by
+// name. A cache is never evicted from; delete the directory to reclaim it.
+// As with the AST cache, files are written under a temporary name and
+// renamed into place.
+// A definition skips the optimizer only once load() has read its object
+// file and found it to be one; the JIT is then handed that very buffer, so
+// a file that goes missing in between cannot leave the unoptimized IR to
+// be compiled, and then cached as if it were optimized.
+class ObjectFileCache : public llvm::ObjectCache {
+	static const uint32_t Version = 3;
+	static const char* prefix() { return "ks-object-"; }
+
+	std::string Dir;
+	std::string Context;  // what every key depends on, besides the ASTs
+
+	// the object code load() has read, by key, until the JIT asks for it;
+	// the JIT may compile on several threads
+	std::mutex Lock;
+	llvm::DenseMap<uint64_t, std::unique_ptr<llvm::MemoryBuffer>> Loaded;
+
+	std::string getPath(uint64_t Key) const {
+		llvm::SmallString<128> Path(Dir);
+		std::string Name;
+		llvm::raw_string_ostream(Name) << llvm::format_hex_no_prefix(Key, 16)
+			<< ".o";
+		llvm::sys::path::append(Path, Name);
+		return Path.str().str();
+	}
+
+	// the key M was named after, if it was
+	static bool getKey(const llvm::Module* M, uint64_t& Key) {
+		llvm::StringRef ID = M->getModuleIdentifier();
+		return ID.consume_front(prefix()) && !ID.getAsInteger(16, Key);
+	}
+
+	template <typename T> static void write(std::string& Out, T Value) {
+		Out.append(reinterpret_cast<const char*>(&Value), sizeof(Value));
+	}
+
+	static void writeName(std::string& Out, llvm::StringRef Name) {
+		write(Out, uint32_t(Name.size()));
+		Out += Name;
+	}
+
+	// append Fn's normalized form to Out: its prototype, then its body in
+	// preorder, each call with its callee's binding in Table
+	static void normalize(std::string& Out, const SymbolTable& Symbols,
+			const FunctionTable& Table, const FunctionAST& Fn) {
+		llvm::ArrayRef<SymbolID> Args = Fn.getProto().getArgs();
+		writeName(Out, Symbols.getName(Fn.getProto().getName()));
+		write(Out, uint32_t(Args.size()));
+		llvm::SmallVector<const ExprAST*, 32> Stack;
+		Stack.push_back(Fn.getBody());
+		while (!Stack.empty()) {
+			const ExprAST* N = Stack.pop_back_val();
+			switch (N->getKind()) {
+			case ExprAST::EK_Number: {
+				double Val = llvm::cast<NumberExprAST>(N)->getVal();
+				uint64_t Bits;
+				memcpy(&Bits, &Val, sizeof(Bits));
+				Out += 'n';
+				write(Out, Bits);
+				break;
+			}
+			case ExprAST::EK_Variable: {
+				// the last argument of that name, as in CodeGen
+				SymbolID Name = llvm::cast<VariableExprAST>(N)->getName();
+				uint32_t I = Args.size();
+				while (I && Args[I - 1] != Name)
+					--I;
+				Out += 'v';
+				write(Out, I);
+				break;
+			}
+			case ExprAST::EK_Binary: {
+				auto B = llvm::cast<BinaryExprAST>(N);
+				Out += 'b';
+				Out += B->getOp();
+				Stack.push_back(B->getRHS());
+				Stack.push_back(B->getLHS());
+				break;
+			}
+			case ExprAST::EK_Call: {
+				auto C = llvm::cast<CallExprAST>(N);
+				CalleeBinding B = Table.Bindings.lookup(C->getCallee());
+				Out += 'c';
+				writeName(Out, Symbols.getName(C->getCallee()));
+				write(Out, uint32_t(C->getArgs().size()));
+				Out += char(B.Kind);
+				write(Out, uint32_t(B.Intrinsic));
+				for (size_t I = C->getArgs().size(); I--;)
+					Stack.push_back(C->getArgs()[I]);
+				break;
+			}
+			}
+		}
+	}
+
+	// the triple, CPU and features of the host, which the JIT compiles for
+	static std::string getHostTarget() {
+		llvm::SubtargetFeatures Features;
+		llvm::StringMap<bool> HostFeatures;
+		if (llvm::sys::getHostCPUFeatures(HostFeatures))
+			for (auto& F : HostFeatures)
+				Features.AddFeature(F.first(), F.second);
+		return llvm::sys::getProcessTriple() + " " +
+			llvm::sys::getHostCPUName().str() + " " + Features.getString();
+	}
+
+	public:
+	// a cache in Dir for object code compiled for the host at OptLevel,
+	// from ASTs that were Simplified or not
+	ObjectFileCache(llvm::StringRef Dir, unsigned OptLevel, bool Simplified)
+			: Dir(Dir) {
+		llvm::raw_string_ostream(Context) << "version=" << unsigned(Version)
+			<< " llvm=" << LLVM_VERSION_STRING << " O" << OptLevel
+			<< " simplify=" << Simplified << " target=" << getHostTarget();
+	}
+
+	// the key for a module holding Fn, given Imported for the inliner, with
+	// the callees bound as in Table
+	uint64_t getKey(const SymbolTable& Symbols, const FunctionTable& Table,
+			const FunctionAST& Fn,
+			llvm::ArrayRef<const FunctionAST*> Imported) const {
+		std::string Text = Context;
+		Text += '\0';
+		normalize(Text, Symbols, Table, Fn);
+		for (const FunctionAST* I : Imported)
+			normalize(Text, Symbols, Table, *I);
+		return llvm::xxHash64(Text);
+	}
+
+	// name M after Key, so that its object code is looked for here, and
+	// saved here once compiled
+	static void setKey(llvm::Module& M, uint64_t Key) {
+		std::string ID = prefix();
+		llvm::raw_string_ostream(ID) << llvm::format_hex_no_prefix(Key, 16);
+		M.setModuleIdentifier(ID);
+	}
+
+	// read the object code cached under Key, and keep it for the JIT to
+	// ask for when it compiles the module named after Key; false if there
+	// is none, or it is not an object file. Only a module whose object code
+	// has been loaded may skip the passes its object code is cached after.
+	bool load(uint64_t Key) {
+		auto Buffer = llvm::MemoryBuffer::getFile(getPath(Key));
+		if (!Buffer) {
+			instrument::count(instrument::C_ObjectCacheMisses);
+			return false;
+		}
+		auto Obj = llvm::object::ObjectFile::createObjectFile(
+			(*Buffer)->getMemBufferRef());
+		if (!Obj) {
+			llvm::consumeError(Obj.takeError());
+			instrument::count(instrument::C_ObjectCacheMisses);
+			return false;
+		}
+		instrument::count(instrument::C_ObjectCacheHits);
+		std::lock_guard<std::mutex> L(Lock);
+		Loaded[Key] = std::move(*Buffer);
+		return true;
+	}
+
+	void notifyObjectCompiled(const llvm::Module* M,
+			llvm::MemoryBufferRef Obj) override {
+		uint64_t Key;
+		if (!getKey(M, Key) || llvm::sys::fs::create_directories(Dir))
+			return;
+		llvm::SmallString<128> Model(Dir), TmpPath;
+		llvm::sys::path::append(Model, "object-%%%%%%%%.tmp");
+		int FD;
+		if (llvm::sys::fs::createUniqueFile(Model, FD, TmpPath))
+			return;
+		bool Failed;
+		{
+			llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+			OS << Obj.getBuffer();
+			OS.close();
+			Failed = OS.has_error();
+			OS.clear_error();
+		}
+		if (Failed || llvm::sys::fs::rename(TmpPath, getPath(Key)))
+			llvm::sys::fs::remove(TmpPath);
+	}
+
+	std::unique_ptr<llvm::MemoryBuffer> getObject(
+			const llvm::Module* M) override {
+		uint64_t Key;
+		if (!getKey(M, Key))
+			return nullptr;
+		std::lock_guard<std::mutex> L(Lock);
+		auto I = Loaded.find(Key);
+		if (I == Loaded.end())
+			return nullptr;
+		std::unique_ptr<llvm::MemoryBuffer> Buffer = std::move(I->second);
+		Loaded.erase(I);
+		return Buffer;
+	}
+};
+
+#endif
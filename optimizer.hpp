@@ -0,0 +1,207 @@
+#ifndef KALEIDOSCOPE_OPTIMIZER_HPP
+#define KALEIDOSCOPE_OPTIMIZER_HPP
+
+#include "instrument.hpp"
+#include "llvm/ADT/Any.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Analysis/InlineCost.h"
+#include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CodeGen.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO/ElimAvailExtern.h"
+#include "llvm/Transforms/IPO/Inliner.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Optimization
+
+// Optimizer -- the pass pipeline run over each module before it goes to
+// the JIT. By level:
+//
+//   -O0: nothing
+//   -O1: instcombine, reassociate, gvn and simplifycfg over each function
+//   -O2: the same, after inlining the functions earlier items defined,
+//        which CodeGen imports as available_externally copies
+//   -O3: as -O2, inlining more eagerly
+//
+// Batch kernels, whose loops are worth vectorizing, get LLVM's own -O3
+// pipeline instead, with the loop and SLP vectorizers, unless at -O0. For
+// those to know the vector width, the Optimizer needs the target machine
+// the JIT compiles for. Each Optimizer needs one of its own, as a target
+// machine is not to be used by two threads at once. Given a vector math
+// library, the loop vectorizer can vectorize the math functions that
+// CodeGen calls as intrinsics, too.
+//
+// Built with KS_INSTRUMENT, each of those passes is timed every time it
+// runs, as is the pipeline as a whole.
+class Optimizer {
+	unsigned Level;
+	llvm::LoopAnalysisManager LAM;
+	llvm::FunctionAnalysisManager FAM;
+	llvm::CGSCCAnalysisManager CGAM;
+	llvm::ModuleAnalysisManager MAM;
+	llvm::PassInstrumentationCallbacks PIC;
+	llvm::PassBuilder PB;
+	llvm::ModulePassManager MPM;
+	// for batch kernels, built when first needed
+	llvm::ModulePassManager KernelMPM;
+	bool HaveKernelMPM = false;
+
+	// a timer for each pass that is running, or nullptr for a pass that has
+	// none
+	std::vector<std::unique_ptr<instrument::ScopedTimer>> Running;
+
+	static llvm::FunctionPassManager createFunctionPasses() {
+		llvm::FunctionPassManager FPM;
+		// do simple "peephole" optimizations and bit-twiddling optzns
+		FPM.addPass(llvm::InstCombinePass());
+		// reassociate expressions
+		FPM.addPass(llvm::ReassociatePass());
+		// eliminate common subexpressions
+		FPM.addPass(llvm::GVNPass());
+		// simplify the control flow graph (deleting unreachable blocks, etc)
+		FPM.addPass(llvm::SimplifyCFGPass());
+		return FPM;
+	}
+
+	// the timer for the pass called PassID, or -1
+	static int getPassTimer(llvm::StringRef PassID) {
+		return llvm::StringSwitch<int>(PassID)
+			.Case("InstCombinePass", instrument::T_PassInstCombine)
+			.Case("ReassociatePass", instrument::T_PassReassociate)
+			.Case("GVNPass", instrument::T_PassGVN)
+			.Case("SimplifyCFGPass", instrument::T_PassSimplifyCFG)
+			.Case("InlinerPass", instrument::T_PassInliner)
+			.Default(-1);
+	}
+
+	static llvm::PipelineTuningOptions getTuningOptions() {
+		llvm::PipelineTuningOptions PTO;
+		PTO.LoopVectorization = true;
+		PTO.SLPVectorization = true;
+		return PTO;
+	}
+
+	void runPasses(llvm::ModulePassManager& Passes, llvm::Module& M) {
+		{
+			instrument::ScopedTimer Timer(instrument::T_Optimize);
+			Passes.run(M, MAM);
+			// the results are for M, which is about to go to the JIT
+			LAM.clear();
+			FAM.clear();
+			CGAM.clear();
+			MAM.clear();
+		}
+		if (instrument::Enabled)
+			instrument::count(instrument::C_IRInstructions, M.getInstructionCount());
+	}
+
+	// the library functions the passes know of, on the target, with the
+	// vector math library's
+	static llvm::TargetLibraryInfoImpl getVectorMathInfo(
+			llvm::TargetMachine* TM) {
+		llvm::TargetLibraryInfoImpl TLII(TM ? TM->getTargetTriple()
+			: llvm::Triple(llvm::sys::getProcessTriple()));
+		TLII.addVectorizableFunctionsFromVecLib(
+			llvm::TargetLibraryInfoImpl::LIBMVEC_X86);
+		return TLII;
+	}
+
+	void registerTimers() {
+		PIC.registerBeforeNonSkippedPassCallback(
+			[this](llvm::StringRef PassID, llvm::Any) {
+				int T = getPassTimer(PassID);
+				Running.push_back(T < 0 ? nullptr : std::make_unique<
+					instrument::ScopedTimer>(instrument::TimerID(T)));
+			});
+		PIC.registerAfterPassCallback(
+			[this](llvm::StringRef, llvm::Any, const llvm::PreservedAnalyses&) {
+				Running.pop_back();
+			});
+		PIC.registerAfterPassInvalidatedCallback(
+			[this](llvm::StringRef, const llvm::PreservedAnalyses&) {
+				Running.pop_back();
+			});
+	}
+
+	public:
+	// Level is 0 to 3; TM, if given, is the JIT's target machine, or one
+	// like it. With VectorMath, the vectorizers may call glibc's vector math
+	// library, libmvec, which must then be loaded for the JIT to find (see
+	// ExternTable::loadVectorMathLibrary()).
+	explicit Optimizer(unsigned Level, llvm::TargetMachine* TM = nullptr,
+			bool VectorMath = false)
+		: Level(Level), PB(TM, getTuningOptions(), llvm::None, &PIC) {
+		if (instrument::Enabled)
+			registerTimers();
+		// registered first, so PassBuilder's default is not
+		if (VectorMath) {
+			llvm::TargetLibraryInfoImpl TLII = getVectorMathInfo(TM);
+			FAM.registerPass([TLII] {
+				return llvm::TargetLibraryAnalysis(TLII);
+			});
+		}
+		PB.registerModuleAnalyses(MAM);
+		PB.registerCGSCCAnalyses(CGAM);
+		PB.registerFunctionAnalyses(FAM);
+		PB.registerLoopAnalyses(LAM);
+		PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+		if (Level >= 2) {
+			// inline bottom-up over the call graph, simplifying each function
+			// before it is inlined into its callers
+			llvm::ModuleInlinerWrapperPass Inliner(llvm::getInlineParams(Level, 0));
+			Inliner.getPM().addPass(llvm::createCGSCCToFunctionPassAdaptor(
+				createFunctionPasses()));
+			MPM.addPass(std::move(Inliner));
+			// the imported copies have done their job
+			MPM.addPass(llvm::EliminateAvailableExternallyPass());
+		}
+		else if (Level == 1)
+			MPM.addPass(llvm::createModuleToFunctionPassAdaptor(
+				createFunctionPasses()));
+	}
+
+	unsigned getLevel() const { return Level; }
+	// whether CodeGen should import the bodies of the functions it calls
+	bool inlines() const { return Level >= 2; }
+
+	// how hard the JIT's code generator should work at Level
+	static llvm::CodeGenOpt::Level getCodeGenLevel(unsigned Level) {
+		static const llvm::CodeGenOpt::Level Levels[] = {llvm::CodeGenOpt::None,
+			llvm::CodeGenOpt::Less, llvm::CodeGenOpt::Default,
+			llvm::CodeGenOpt::Aggressive};
+		return Levels[Level];
+	}
+	llvm::CodeGenOpt::Level getCodeGenLevel() const {
+		return getCodeGenLevel(Level);
+	}
+
+	void run(llvm::Module& M) { runPasses(MPM, M); }
+
+	// optimize M, which holds a batch kernel
+	void runKernel(llvm::Module& M) {
+		if (!HaveKernelMPM && Level)
+			KernelMPM = PB.buildPerModuleDefaultPipeline(
+				llvm::OptimizationLevel::O3);
+		HaveKernelMPM = true;
+		runPasses(KernelMPM, M);
+	}
+};
+
+#endif
@@ -0,0 +1,482 @@
+#ifndef KALEIDOSCOPE_PARSER_HPP
+#define KALEIDOSCOPE_PARSER_HPP
+
+#include "ast.hpp"
+#include "instrument.hpp"
+#include "lexer.hpp"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+// ===============================
+//       parser
+// ===============================
+
+// Parser -- recursive descent over the tokens of one Lexer, or of a range
+// of a pre-lexed TokenBuffer. All of the parser's state lives here, so any
+// number of parsers can run at once on different threads. (A Lexer's
+// parser must be on the Lexer's thread; parsers over one TokenBuffer only
+// read it.)
+class Parser {
+	// where the tokens come from: the lexer, or else Tokens[NextTok, EndTok).
+	// Reaching EndTok reads as tok_eof, unless NextBlock hands over another
+	// block of tokens.
+	Lexer* Lex = nullptr;
+	const TokenBuffer* Tokens = nullptr;
+	size_t NextTok = 0, EndTok = 0;
+	std::function<const TokenBuffer*()> NextBlock;
+
+	DiagnosticEngine& Diags;  // where syntax errors are reported
+
+	// CurTok is the current token the parser is looking at, and
+	// IdentifierSym/NumVal its value
+	int CurTok = 0;
+	SymbolID IdentifierSym = 0;
+	double NumVal = 0;
+
+	// the precedence of each byte as a binary operator, indexed by the
+	// token (which for an operator is its character); -1 if it isn't one
+	int BinopPrecedence[256];
+
+	// parse expressions with ParseExpressionIterative
+	bool Iterative = false;
+	// print "Parsed ..." for each item ParseTopLevelItem parses
+	bool ReportItems = true;
+
+	// the arena that expression nodes are allocated in; each top-level item
+	// gets a fresh one
+	ASTArena* CurArena = nullptr;
+
+	int GetTokPrecedence();
+	ExprAST* LogError(DiagID ID);
+	std::unique_ptr<PrototypeAST> LogErrorP(DiagID ID);
+
+	ExprAST* ParseNumberExpr();
+	ExprAST* ParseParenExpr();
+	ExprAST* ParseIdentifierExpr();
+	ExprAST* ParsePrimary();
+	ExprAST* ParseBinOpRHS(int ExprPrec, ExprAST* LHS);
+	ExprAST* ParseExpressionIterative();
+	ExprAST* ParseExpression();
+	std::unique_ptr<PrototypeAST> ParsePrototype();
+
+	public:
+	// parse tokens as Lex produces them
+	Parser(Lexer& Lex, DiagnosticEngine& Diags) : Lex(&Lex), Diags(Diags) {
+		std::fill(std::begin(BinopPrecedence), std::end(BinopPrecedence), -1);
+	}
+
+	// parse Tokens[Begin, End), as if the input stopped at End
+	Parser(const TokenBuffer& Tokens, size_t Begin, size_t End,
+			DiagnosticEngine& Diags)
+		: Tokens(&Tokens), NextTok(Begin), EndTok(End), Diags(Diags) {
+		std::fill(std::begin(BinopPrecedence), std::end(BinopPrecedence), -1);
+	}
+
+	// parse a stream of token blocks. NextBlock returns the next block, or
+	// nullptr at the end of the stream; the block before it is then no
+	// longer used, so far as tokens go.
+	Parser(std::function<const TokenBuffer*()> NextBlock,
+			DiagnosticEngine& Diags)
+		: NextBlock(std::move(NextBlock)), Diags(Diags) {
+		std::fill(std::begin(BinopPrecedence), std::end(BinopPrecedence), -1);
+	}
+
+	// make Op a binary operator; a precedence of 0 or less unmakes it
+	void setBinopPrecedence(char Op, int Prec) {
+		BinopPrecedence[(unsigned char)Op] = Prec > 0 ? Prec : -1;
+	}
+	int getBinopPrecedence(char Op) const {
+		return BinopPrecedence[(unsigned char)Op];
+	}
+	void setIterative(bool On) { Iterative = On; }
+	// whether ParseTopLevelItem reports each item it parses
+	void setReportItems(bool On) { ReportItems = On; }
+
+	DiagnosticEngine& getDiags() const { return Diags; }
+	// where the parser prints, errors and all
+	llvm::raw_ostream& errs() const { return Diags.getStream(); }
+
+	// getNextToken reads another token and updates CurTok with it
+	int getCurTok() const { return CurTok; }
+	int getNextToken() {
+		if (Lex) {
+			CurTok = Lex->gettok();
+			if (CurTok == tok_identifier)
+				IdentifierSym = Lex->getIdentifierSym();
+			else if (CurTok == tok_number)
+				NumVal = Lex->getNumVal();
+			return CurTok;
+		}
+
+		while (NextTok == EndTok) {
+			const TokenBuffer* Next = NextBlock ? NextBlock() : nullptr;
+			if (!Next)
+				return CurTok = tok_eof;
+			Tokens = Next;
+			NextTok = 0;
+			EndTok = Next->size();
+		}
+		size_t I = NextTok++;
+		CurTok = Tokens->Kind[I];
+		if (CurTok == tok_identifier)
+			IdentifierSym = Tokens->Value[I];
+		else if (CurTok == tok_number)
+			NumVal = Tokens->Numbers[Tokens->Value[I]];
+		else if (CurTok == tok_error && Tokens->Value[I] < Tokens->Errors.size()) {
+			const LexError& E = Tokens->Errors[Tokens->Value[I]];
+			Diags.reportRendered(E.Diag, E.Text);
+		}
+		return CurTok;
+	}
+
+	// where CurTok starts in the source. The tok_eof at the end of a range
+	// is where the token after the range starts, or where the buffer's own
+	// tok_eof does if there is none.
+	uint32_t getTokOffset() const {
+		if (Lex)
+			return Lex->getTokOffset();
+		return Tokens->Offset[NextTok == EndTok && CurTok == tok_eof &&
+			EndTok < Tokens->size() ? EndTok : NextTok - 1];
+	}
+
+	// for a TokenBuffer parser: the index of CurTok, and a way to move it
+	size_t getTokenIndex() const { return NextTok - 1; }
+	int seek(size_t Index) {
+		NextTok = Index;
+		return getNextToken();
+	}
+
+	std::unique_ptr<FunctionAST> ParseDefinition();
+	std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+	std::unique_ptr<PrototypeAST> ParseExtern();
+	TopLevelItem ParseTopLevelItem();
+};
+
+// get the precedence of the pending binary operator token
+inline int Parser::GetTokPrecedence() {
+	// the Token kinds are all negative, so they fail the range check
+	return unsigned(CurTok) < 256 ? BinopPrecedence[CurTok] : -1;
+}
+
+// report an error at the current token
+inline ExprAST* Parser::LogError(DiagID ID) {
+	Diags.report(ID, getTokOffset());
+	return nullptr;
+}
+
+inline std::unique_ptr<PrototypeAST> Parser::LogErrorP(DiagID ID) {
+	LogError(ID);
+	return nullptr;
+}
+
+// numberexpr ::= number
+inline ExprAST* Parser::ParseNumberExpr() {
+	auto Result = CurArena->make<NumberExprAST>(NumVal);
+	getNextToken();
+	return Result;
+}
+
+// parenexpr ::= '(' expression ')'
+inline ExprAST* Parser::ParseParenExpr() {
+	getNextToken();
+	auto V = ParseExpression();
+	if (!V)
+		return nullptr;
+	if (CurTok != ')')
+		return LogError(err_expected_rparen);
+	getNextToken();
+	return V;
+}
+
+//  identifierexpr
+//    ::= identifier
+//    ::= identifier '(' expression* ')'
+inline ExprAST* Parser::ParseIdentifierExpr() {
+	SymbolID IdName = IdentifierSym;
+	getNextToken();  // eat identifier
+
+	if (CurTok != '(')  // simple variable ref.
+		return CurArena->make<VariableExprAST>(IdName);
+
+	// call
+	getNextToken(); // eat (
+	llvm::SmallVector<ExprAST*, 8> Args;
+	if (CurTok != ')') {
+		while (true) {
+			if (auto Arg = ParseExpression())
+				Args.push_back(Arg);
+			else
+				return nullptr;
+
+			if (CurTok == ')')
+				break;
+
+			if (CurTok != ',')
+				return LogError(err_expected_rparen_or_comma);
+			getNextToken();
+		}
+	}
+
+	getNextToken(); // eat ')'
+	return CurArena->make<CallExprAST>(IdName,
+		CurArena->copy(llvm::ArrayRef<ExprAST*>(Args)));
+}
+
+// primary
+//   ::= identierexpr
+//   ::= numberexpr
+//   ::= parenexpr
+inline ExprAST* Parser::ParsePrimary() {
+	switch (CurTok) {
+	default:
+		return LogError(err_unknown_token);
+	case tok_error:
+		return nullptr;
+	case tok_identifier:
+		return ParseIdentifierExpr();
+	case tok_number:
+		return ParseNumberExpr();
+	case '(':
+		return ParseParenExpr();
+	}
+}
+
+// binoprhs
+//   ::= ('+' primary)*
+inline ExprAST* Parser::ParseBinOpRHS(int ExprPrec, ExprAST* LHS) {
+	while (true) {
+		int TokPrec = GetTokPrecedence();
+		if (TokPrec < ExprPrec)
+			return LHS;
+
+		int BinOp = CurTok;
+		getNextToken();
+
+		auto RHS = ParsePrimary();
+		if (!RHS) return nullptr;
+
+		int NextPrec = GetTokPrecedence();
+		if (TokPrec < NextPrec) {
+			RHS = ParseBinOpRHS(TokPrec + 1, RHS);
+			if (!RHS) return nullptr;
+		}
+
+		LHS = CurArena->make<BinaryExprAST>(BinOp, LHS, RHS);
+	}
+}
+
+// the same grammar as ParseBinOpRHS/ParsePrimary, parsed with explicit
+// operator and operand stacks instead of recursion, so that neither long
+// operator chains nor deep nesting use up the C stack. Builds exactly the
+// trees the recursive parser does, and reports the same errors at the
+// same tokens.
+inline ExprAST* Parser::ParseExpressionIterative() {
+	// an open construct: a binary operator waiting for its RHS, a
+	// parenthesis, or a call whose arguments start at Operands[ArgBase]
+	struct Frame {
+		enum { Binop, Paren, Call } Kind;
+		int Op;
+		int Prec;
+		SymbolID Callee;
+		unsigned ArgBase;
+	};
+	llvm::SmallVector<ExprAST*, 16> Operands;
+	llvm::SmallVector<Frame, 16> Frames;
+
+	// fold pending binary operators of at least MinPrec into their operands
+	auto Reduce = [&](int MinPrec) {
+		while (!Frames.empty() && Frames.back().Kind == Frame::Binop &&
+				Frames.back().Prec >= MinPrec) {
+			ExprAST* RHS = Operands.pop_back_val();
+			ExprAST* LHS = Operands.back();
+			Operands.back() = CurArena->make<BinaryExprAST>(Frames.back().Op, LHS,
+				RHS);
+			Frames.pop_back();
+		}
+	};
+
+	while (true) {
+		// primary
+		switch (CurTok) {
+		default:
+			return LogError(err_unknown_token);
+		case tok_error:
+			return nullptr;
+		case tok_number:
+			Operands.push_back(CurArena->make<NumberExprAST>(NumVal));
+			getNextToken();
+			break;
+		case '(':
+			getNextToken();
+			Frames.push_back(Frame{Frame::Paren, 0, 0, 0, 0});
+			continue;
+		case tok_identifier: {
+			SymbolID IdName = IdentifierSym;
+			getNextToken();  // eat identifier
+			if (CurTok != '(') {
+				Operands.push_back(CurArena->make<VariableExprAST>(IdName));
+				break;
+			}
+			getNextToken(); // eat (
+			if (CurTok == ')') {
+				getNextToken();
+				Operands.push_back(CurArena->make<CallExprAST>(IdName,
+					llvm::ArrayRef<ExprAST*>()));
+				break;
+			}
+			Frames.push_back(Frame{Frame::Call, 0, 0, IdName,
+				unsigned(Operands.size())});
+			continue;
+		}
+		}
+
+		// after an operand: continue a binoprhs, or close the innermost
+		// parenthesis or call
+		while (true) {
+			int TokPrec = GetTokPrecedence();
+			if (TokPrec >= 0) {
+				Reduce(TokPrec);
+				Frames.push_back(Frame{Frame::Binop, CurTok, TokPrec, 0, 0});
+				getNextToken();
+				break;
+			}
+
+			Reduce(0);
+			if (Frames.empty())
+				return Operands.back();
+
+			Frame& F = Frames.back();
+			if (F.Kind == Frame::Paren) {
+				if (CurTok != ')')
+					return LogError(err_expected_rparen);
+				getNextToken();
+				Frames.pop_back();
+				continue;
+			}
+
+			if (CurTok == ')') {
+				llvm::ArrayRef<ExprAST*> Args =
+					llvm::makeArrayRef(Operands).slice(F.ArgBase);
+				ExprAST* Call = CurArena->make<CallExprAST>(F.Callee,
+					CurArena->copy(Args));
+				Operands.resize(F.ArgBase);
+				Operands.push_back(Call);
+				Frames.pop_back();
+				getNextToken(); // eat ')'
+				continue;
+			}
+			if (CurTok != ',')
+				return LogError(err_expected_rparen_or_comma);
+			getNextToken();
+			break;
+		}
+	}
+}
+
+// expression 
+//   ::= primary binoprhs
+inline ExprAST* Parser::ParseExpression() {
+	instrument::ScopedTimer Timer(instrument::T_ParseExpression);
+	if (Iterative)
+		return ParseExpressionIterative();
+	auto LHS = ParsePrimary();
+	if (!LHS) return nullptr;
+	return ParseBinOpRHS(0, LHS);
+}
+
+// prototype
+//   ::= id '(' id* ')'
+inline std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
+	if (CurTok != tok_identifier)
+		return LogErrorP(err_expected_function_name);
+	SymbolID FnName = IdentifierSym;
+	getNextToken();
+
+	if (CurTok != '(')
+		return LogErrorP(err_expected_lparen_in_prototype);
+
+	std::vector<SymbolID> ArgNames;
+	while (getNextToken() == tok_identifier)
+		ArgNames.push_back(IdentifierSym);
+	if (CurTok != ')')
+		return LogErrorP(err_expected_rparen_in_prototype);
+
+	getNextToken();
+	return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
+}
+
+// defintion
+//   ::= 'def' prototype expression
+inline std::unique_ptr<FunctionAST> Parser::ParseDefinition() {
+	getNextToken();
+	auto Proto = ParsePrototype();
+	if (!Proto) return nullptr;
+	auto Arena = std::make_unique<ASTArena>();
+	CurArena = Arena.get();
+	if (auto E = ParseExpression())
+		return std::make_unique<FunctionAST>(std::move(Arena), std::move(Proto),
+			E);
+	return nullptr;
+}
+
+// toplevelexpr
+//   ::= expression
+inline std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr() {
+	auto Arena = std::make_unique<ASTArena>();
+	CurArena = Arena.get();
+	if (auto E = ParseExpression()) {
+		auto Proto = std::make_unique<PrototypeAST>(sym_anon_expr,
+			std::vector<SymbolID>());
+		return std::make_unique<FunctionAST>(std::move(Arena), std::move(Proto),
+			E);
+	}
+	return nullptr;
+}
+
+// external 
+//   ::= 'extern' prototype
+inline std::unique_ptr<PrototypeAST> Parser::ParseExtern() {
+	getNextToken();
+	return ParsePrototype();
+}
+
+// top
+//   ::= definition | external | expression | ';'
+// reports each item parsed (unless told not to), and on an error skips
+// the token the parse gave up at, so the next item can start
+inline TopLevelItem Parser::ParseTopLevelItem() {
+	TopLevelItem Item{TopLevelItem::TK_TopLevelExpr, nullptr, nullptr, false};
+	switch (CurTok) {
+	case ';':
+		Item.Kind = TopLevelItem::TK_Semicolon;
+		getNextToken();
+		return Item;
+	case tok_def:
+		Item.Kind = TopLevelItem::TK_Definition;
+		if ((Item.Function = ParseDefinition()) && ReportItems)
+			errs() << "Parsed a function definition.\n";
+		break;
+	case tok_extern:
+		Item.Kind = TopLevelItem::TK_Extern;
+		if ((Item.Proto = ParseExtern()) && ReportItems)
+			errs() << "Parsed an extern\n";
+		break;
+	default:
+		if ((Item.Function = ParseTopLevelExpr()) && ReportItems)
+			errs() << "Parsed a top-level expr\n";
+		break;
+	}
+	if (Item.failed()) {
+		Item.RecoveredAtEnd = CurTok == tok_eof;
+		getNextToken();
+	}
+	return Item;
+}
+
+#endif
@@ -0,0 +1,204 @@
+#ifndef KALEIDOSCOPE_PIPELINE_HPP
+#define KALEIDOSCOPE_PIPELINE_HPP
+
+#include "ast.hpp"
+#include "diagnostics.hpp"
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "source_buffer.hpp"
+#include "spsc_queue.hpp"
+#include "symbol_table.hpp"
+#include "llvm/Support/raw_ostream.h"
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Pipelined front end
+
+// Pipeline -- lexes, parses and consumes the input on three threads at
+// once:
+//
+//   lexer thread:  gettok() into blocks of tokens, passed on through a ring
+//   parser thread: top-level items from the token blocks, passed on
+//                  through a second ring
+//   caller:        hands each item to a callback, in source order
+//
+// Memory stays bounded however long the input is: there is a fixed number
+// of token blocks, which go back to the lexer once parsed, the item ring
+// has a fixed size, and the source buffer drops the input that has been
+// lexed. (Only the symbol table keeps growing, with each new name,
+// and with line tracking, the line index.)
+//
+// A block is passed on when it is full, at the end of the input, and just
+// before the lexer waits for more input, so an interactive parse sees every
+// token that has been typed.
+class Pipeline {
+	public:
+	// an item and what parsing it printed, including the prompt after it.
+	// The first output has no item: it holds what was printed before the
+	// first item started.
+	struct Output {
+		std::string Messages;
+		std::unique_ptr<TopLevelItem> Item;
+	};
+
+	private:
+	static const size_t NumBlocks = 8;
+	static const size_t BlockTokens = 4096;
+	static const size_t ItemCapacity = 64;
+
+	SourceBuffer& Source;
+	SymbolTable& Symbols;
+	std::function<void(Parser&)> Configure;
+	bool Prompts = true;
+
+	TokenBuffer Blocks[NumBlocks];
+	SPSCQueue<TokenBuffer*> Full, Free;
+	SPSCQueue<Output> Items;
+
+	// what the parser prints, until it is passed on with the next output
+	std::string Buffer;
+	llvm::raw_string_ostream Messages;
+	DiagnosticEngine Diags;
+	// with line tracking, the lines of the input lexed so far
+	LineIndex Lines;
+	bool TrackLines = false;
+
+	void lex() {
+		// errors are rendered here, while the source they quote is still
+		// there, and reported again by the parser
+		std::string Message;
+		llvm::raw_string_ostream Errs(Message);
+		DiagnosticEngine LexDiags(Errs, &Source);
+		Lexer Lex(Source, Symbols, LexDiags);
+
+		// the lines are found before the tokens on them are passed on, and
+		// before the input is discarded; the parser only looks them up
+		auto ScanLines = [&] {
+			if (TrackLines)
+				Lines.scanTo(Source.offsetOf(Source.end()));
+		};
+		TokenBuffer* Block;
+		Free.pop(Block);
+		auto PassOn = [&] {
+			ScanLines();
+			Full.push(Block);
+			Free.pop(Block);
+			Block->clear();
+		};
+		Source.setReadHook([&] {
+			ScanLines();
+			if (!Block->empty())
+				PassOn();
+		});
+
+		int Tok;
+		do {
+			Tok = Lex.gettok();
+			uint32_t Val = 0;
+			if (Tok == tok_identifier)
+				Val = Lex.getIdentifierSym();
+			else if (Tok == tok_number) {
+				Val = Block->Numbers.size();
+				Block->Numbers.push_back(Lex.getNumVal());
+			}
+			else if (Tok == tok_error) {
+				Val = Block->Errors.size();
+				Block->Errors.push_back(LexError{LexDiags.getDiagnostics().back(),
+					std::move(Errs.str())});
+				Message.clear();
+				LexDiags.clear();
+			}
+			Block->push(Tok, Lex.getTokOffset(), Val);
+			if (Tok == tok_eof) {
+				ScanLines();
+				Full.push(Block);
+			}
+			else if (Block->size() == BlockTokens)
+				PassOn();
+		} while (Tok != tok_eof);
+
+		Source.setReadHook(nullptr);
+		Full.close();
+	}
+
+	void parse() {
+		TokenBuffer* Current = nullptr;
+		Parser P([this, &Current]() -> const TokenBuffer* {
+			if (Current)
+				Free.push(Current);
+			if (!Full.pop(Current))
+				Current = nullptr;
+			return Current;
+		}, Diags);
+		Configure(P);
+
+		// the same prompts as MainLoop
+		prompt();
+		P.getNextToken();
+		prompt();
+		emit(nullptr);
+		while (P.getCurTok() != tok_eof) {
+			std::unique_ptr<TopLevelItem> Item(
+				new TopLevelItem(P.ParseTopLevelItem()));
+			prompt();
+			emit(std::move(Item));
+		}
+		Items.close();
+	}
+
+	void prompt() {
+		if (Prompts)
+			Messages << "ready> ";
+	}
+
+	void emit(std::unique_ptr<TopLevelItem> Item) {
+		Messages.flush();
+		Items.push(Output{std::move(Buffer), std::move(Item)});
+		Buffer.clear();
+	}
+
+	public:
+	// Configure sets up the parser, e.g. with its binary operators
+	Pipeline(SourceBuffer& Source, SymbolTable& Symbols,
+			std::function<void(Parser&)> Configure)
+		: Source(Source), Symbols(Symbols), Configure(std::move(Configure)),
+		Full(NumBlocks), Free(NumBlocks), Items(ItemCapacity), Messages(Buffer),
+		Diags(Messages), Lines(Source) {}
+
+	// whether the outputs include MainLoop's "ready> " prompts
+	void setPrompts(bool On) { Prompts = On; }
+
+	// keep the line starts of the input as it is lexed, so that the
+	// parser's errors can be deduplicated by line. They are kept to the
+	// end, so memory grows with the number of lines.
+	void setTrackLines(bool On) {
+		TrackLines = On;
+		Diags.setDedupeLines(On ? &Lines : nullptr);
+	}
+
+	// run the whole input through, calling Consume on this thread with each
+	// output in turn
+	void run(const std::function<void(Output&)>& Consume) {
+		for (TokenBuffer& B : Blocks)
+			Free.push(&B);
+		Source.setDiscard(true);
+		Symbols.setShared(true);
+
+		std::thread Lexing([this] { lex(); });
+		std::thread Parsing([this] { parse(); });
+		Output Out;
+		while (Items.pop(Out))
+			Consume(Out);
+		Parsing.join();
+		Lexing.join();
+
+		Symbols.setShared(false);
+		Source.setDiscard(false);
+	}
+};
+
+#endif
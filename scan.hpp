@@ -0,0 +1,181 @@
+#ifndef KALEIDOSCOPE_SCAN_HPP
+#define KALEIDOSCOPE_SCAN_HPP
+
+#include "llvm/Support/MathExtras.h"
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define KS_SCAN_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define KS_SCAN_SSE2 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define KS_SCAN_NEON 1
+#endif
+
+// Byte-run scanners for the lexer. Each returns a pointer to the first
+// byte at or after P that does not belong to the run:
+//
+//   findNonSpace     -- skips ' ', \t, \n, \v, \f, \r
+//   findNonIdentChar -- skips [a-zA-Z0-9]
+//   findEndOfLine    -- skips anything but \n, \r and '\0'
+//
+// None of the runs includes '\0', so a NUL-terminated buffer always stops
+// them. The vector versions compare a whole block (16 bytes with SSE2 or
+// NEON, 32 with AVX2 -- build with -mavx2 or -march=native to get it) and
+// may read up to ScanOverread bytes past the terminating NUL, so the
+// buffer must be padded by at least that much.
+
+#if KS_SCAN_AVX2
+static const unsigned ScanOverread = 32;
+#else
+static const unsigned ScanOverread = 16;
+#endif
+
+namespace scan_detail {
+
+	inline bool isSpace(unsigned char C) {
+		return C == ' ' || unsigned(C - '\t') <= '\r' - '\t';
+	}
+
+	inline bool isIdentChar(unsigned char C) {
+		return unsigned((C | 0x20) - 'a') <= 'z' - 'a' || unsigned(C - '0') <= 9;
+	}
+
+	inline bool isEndOfLine(unsigned char C) {
+		return C == '\n' || C == '\r' || C == 0;
+	}
+
+#if KS_SCAN_AVX2
+	typedef __m256i Block;
+	static const unsigned BlockSize = 32;
+
+	inline Block load(const char* P) {
+		return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(P));
+	}
+	inline Block splat(char C) { return _mm256_set1_epi8(C); }
+	inline Block eq(Block A, Block B) { return _mm256_cmpeq_epi8(A, B); }
+	inline Block orb(Block A, Block B) { return _mm256_or_si256(A, B); }
+	inline Block sub(Block A, Block B) { return _mm256_sub_epi8(A, B); }
+	// A <= B, as unsigned bytes
+	inline Block ule(Block A, Block B) { return eq(_mm256_min_epu8(A, B), A); }
+	// bit I set if byte I of M is set
+	inline uint64_t bits(Block M) { return uint32_t(_mm256_movemask_epi8(M)); }
+	inline unsigned firstSet(uint64_t Bits) {
+		return llvm::countTrailingZeros(Bits);
+	}
+#elif KS_SCAN_SSE2
+	typedef __m128i Block;
+	static const unsigned BlockSize = 16;
+
+	inline Block load(const char* P) {
+		return _mm_loadu_si128(reinterpret_cast<const __m128i*>(P));
+	}
+	inline Block splat(char C) { return _mm_set1_epi8(C); }
+	inline Block eq(Block A, Block B) { return _mm_cmpeq_epi8(A, B); }
+	inline Block orb(Block A, Block B) { return _mm_or_si128(A, B); }
+	inline Block sub(Block A, Block B) { return _mm_sub_epi8(A, B); }
+	inline Block ule(Block A, Block B) { return eq(_mm_min_epu8(A, B), A); }
+	inline uint64_t bits(Block M) { return uint32_t(_mm_movemask_epi8(M)); }
+	inline unsigned firstSet(uint64_t Bits) {
+		return llvm::countTrailingZeros(Bits);
+	}
+#elif KS_SCAN_NEON
+	typedef uint8x16_t Block;
+	static const unsigned BlockSize = 16;
+
+	inline Block load(const char* P) {
+		return vld1q_u8(reinterpret_cast<const uint8_t*>(P));
+	}
+	inline Block splat(char C) { return vdupq_n_u8(C); }
+	inline Block eq(Block A, Block B) { return vceqq_u8(A, B); }
+	inline Block orb(Block A, Block B) { return vorrq_u8(A, B); }
+	inline Block sub(Block A, Block B) { return vsubq_u8(A, B); }
+	inline Block ule(Block A, Block B) { return vcleq_u8(A, B); }
+	// NEON has no movemask; narrow each byte to a nibble instead, so byte
+	// I of M is bits [4I, 4I+4) of the result
+	inline uint64_t bits(Block M) {
+		uint8x8_t N = vshrn_n_u16(vreinterpretq_u16_u8(M), 4);
+		return vget_lane_u64(vreinterpret_u64_u8(N), 0);
+	}
+	inline unsigned firstSet(uint64_t Bits) {
+		return llvm::countTrailingZeros(Bits) / 4;
+	}
+#endif
+
+#ifdef KS_SCAN_NEON
+	static const uint64_t AllBits = ~uint64_t(0);
+#elif defined(KS_SCAN_AVX2) || defined(KS_SCAN_SSE2)
+	static const uint64_t AllBits = (uint64_t(1) << BlockSize) - 1;
+#endif
+
+} // end namespace scan_detail
+
+#if KS_SCAN_AVX2 || KS_SCAN_SSE2 || KS_SCAN_NEON
+
+inline const char* findNonSpace(const char* P) {
+	using namespace scan_detail;
+	// short runs (a single separating blank) are the common case
+	if (!isSpace(*P))
+		return P;
+	const Block Space = splat(' '), Tab = splat('\t'), Range = splat('\r' - '\t');
+	while (true) {
+		Block B = load(P);
+		uint64_t In = bits(orb(eq(B, Space), ule(sub(B, Tab), Range)));
+		if (In != AllBits)
+			return P + firstSet(~In);
+		P += BlockSize;
+	}
+}
+
+inline const char* findNonIdentChar(const char* P) {
+	using namespace scan_detail;
+	const Block Lower = splat(0x20), A = splat('a'), Letters = splat('z' - 'a');
+	const Block Zero = splat('0'), Digits = splat(9);
+	while (true) {
+		Block B = load(P);
+		uint64_t In = bits(orb(ule(sub(orb(B, Lower), A), Letters),
+			ule(sub(B, Zero), Digits)));
+		if (In != AllBits)
+			return P + firstSet(~In);
+		P += BlockSize;
+	}
+}
+
+inline const char* findEndOfLine(const char* P) {
+	using namespace scan_detail;
+	const Block NL = splat('\n'), CR = splat('\r'), Nul = splat(0);
+	while (true) {
+		Block B = load(P);
+		uint64_t End = bits(orb(orb(eq(B, NL), eq(B, CR)), eq(B, Nul)));
+		if (End)
+			return P + firstSet(End);
+		P += BlockSize;
+	}
+}
+
+#else // scalar fallback
+
+inline const char* findNonSpace(const char* P) {
+	while (scan_detail::isSpace(*P))
+		++P;
+	return P;
+}
+
+inline const char* findNonIdentChar(const char* P) {
+	while (scan_detail::isIdentChar(*P))
+		++P;
+	return P;
+}
+
+inline const char* findEndOfLine(const char* P) {
+	while (!scan_detail::isEndOfLine(*P))
+		++P;
+	return P;
+}
+
+#endif
+
+#endif
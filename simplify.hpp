@@ -0,0 +1,236 @@
+#ifndef KALEIDOSCOPE_SIMPLIFY_HPP
+#define KALEIDOSCOPE_SIMPLIFY_HPP
+
+#include "ast.hpp"
+#include "instrument.hpp"
+#include "symbol_table.hpp"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Casting.h"
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+// AST simplification
+
+// Simplifier -- rewrites a function's body before codegen, so that huge
+// generated expressions hand LLVM less IR to build and optimize. Working
+// bottom up, it
+//
+//   - folds operators whose operands are both numbers, computing them as
+//     the generated code would, so "2 * 3.14159 * x" becomes "6.28318 * x"
+//   - drops the operand of an identity that holds for every double: x * 1,
+//     1 * x, x - 0, x + -0 and -0 + x are all x. x + 0 is not (it is +0
+//     for x = -0), nor is x * 0 (NaN for x = inf or NaN, -0 for x < 0), so
+//     those are left alone, as is reassociating x * 2 * 3, which can
+//     overflow where x * 6 does not
+//   - shares identical subtrees: the nodes of the rewritten body are
+//     hash-consed, so each distinct subexpression is one node, used by all
+//     of its parents, and CodeGen generates it once. Subtrees with a call
+//     in them are not shared, as an extern may have side effects, which
+//     must happen as often, and in the same order, as they are written
+//
+// so the result is bit for bit what the original would have computed.
+// Only the operators there are instructions for are folded: the others
+// are left for CodeGen's check to report.
+//
+// A body becomes a DAG, but no bigger a one (traversing it visits no more
+// nodes than the original tree had), and the nodes are still in the
+// function's arena. Uses an explicit stack, like printExpr(), so it copes
+// with any tree the parser can build.
+class Simplifier {
+	// the canonical node of each number, variable and call-free binary
+	// operator in the body being simplified
+	llvm::DenseMap<uint64_t, NumberExprAST*> Numbers;
+	llvm::DenseMap<SymbolID, VariableExprAST*> Variables;
+	llvm::DenseMap<std::pair<ExprAST*, ExprAST*>, BinaryExprAST*> Binaries[4];
+
+	// a simplified subtree, and whether it is free of calls
+	struct Result {
+		ExprAST* E;
+		bool Shareable;
+	};
+
+	static int getOpIndex(char Op) {
+		switch (Op) {
+		case '+':
+			return 0;
+		case '-':
+			return 1;
+		case '*':
+			return 2;
+		case '<':
+			return 3;
+		default:
+			return -1;
+		}
+	}
+
+	// L Op R, as CodeGen::emitBinary() computes it
+	static double fold(char Op, double L, double R) {
+		switch (Op) {
+		case '+':
+			return L + R;
+		case '-':
+			return L - R;
+		case '*':
+			return L * R;
+		default:
+			// fcmp ult: true if less, or if either is NaN
+			return !(L >= R) ? 1.0 : 0.0;
+		}
+	}
+
+	static uint64_t getBits(double Val) {
+		uint64_t Bits;
+		memcpy(&Bits, &Val, sizeof(Bits));
+		return Bits;
+	}
+
+	static bool isNumber(const ExprAST* E, double Val) {
+		auto N = llvm::dyn_cast<NumberExprAST>(E);
+		return N && getBits(N->getVal()) == getBits(Val);
+	}
+
+	// the canonical node for Val, N if it has none yet and N is for Val
+	NumberExprAST* getNumber(ASTArena& Arena, double Val,
+			NumberExprAST* N = nullptr) {
+		// NaNs are not shared: their bits may be DenseMap's reserved keys
+		if (std::isnan(Val))
+			return N ? N : Arena.make<NumberExprAST>(Val);
+		NumberExprAST*& Canonical = Numbers[getBits(Val)];
+		if (!Canonical)
+			Canonical = N ? N : Arena.make<NumberExprAST>(Val);
+		else if (N && N != Canonical)
+			instrument::count(instrument::C_ExprsShared);
+		return Canonical;
+	}
+
+	// B with its operands simplified to L and R
+	Result simplifyBinary(ASTArena& Arena, BinaryExprAST* B, Result L,
+			Result R) {
+		char Op = B->getOp();
+		int OpIndex = getOpIndex(Op);
+		if (OpIndex < 0)
+			return {L.E == B->getLHS() && R.E == B->getRHS() ? B
+				: Arena.make<BinaryExprAST>(Op, L.E, R.E), false};
+
+		auto LNum = llvm::dyn_cast<NumberExprAST>(L.E);
+		auto RNum = llvm::dyn_cast<NumberExprAST>(R.E);
+		if (LNum && RNum) {
+			instrument::count(instrument::C_ExprsFolded);
+			return {getNumber(Arena, fold(Op, LNum->getVal(), RNum->getVal())),
+				true};
+		}
+		if ((Op == '*' && isNumber(R.E, 1.0)) || (Op == '-' &&
+				isNumber(R.E, 0.0)) || (Op == '+' && isNumber(R.E, -0.0))) {
+			instrument::count(instrument::C_ExprsFolded);
+			return L;
+		}
+		if ((Op == '*' && isNumber(L.E, 1.0)) ||
+				(Op == '+' && isNumber(L.E, -0.0))) {
+			instrument::count(instrument::C_ExprsFolded);
+			return R;
+		}
+
+		bool Unchanged = L.E == B->getLHS() && R.E == B->getRHS();
+		if (!L.Shareable || !R.Shareable)
+			return {Unchanged ? B : Arena.make<BinaryExprAST>(Op, L.E, R.E),
+				false};
+		BinaryExprAST*& Canonical = Binaries[OpIndex][std::make_pair(L.E, R.E)];
+		if (Canonical)
+			instrument::count(instrument::C_ExprsShared);
+		else
+			Canonical = Unchanged ? B : Arena.make<BinaryExprAST>(Op, L.E, R.E);
+		return {Canonical, true};
+	}
+
+	// C with its arguments simplified to Args
+	static Result simplifyCall(ASTArena& Arena, CallExprAST* C,
+			llvm::ArrayRef<Result> Args) {
+		bool Unchanged = true;
+		llvm::SmallVector<ExprAST*, 8> NewArgs;
+		for (size_t I = 0; I != Args.size(); ++I) {
+			NewArgs.push_back(Args[I].E);
+			Unchanged &= Args[I].E == C->getArgs()[I];
+		}
+		if (Unchanged)
+			return {C, false};
+		return {Arena.make<CallExprAST>(C->getCallee(),
+			Arena.copy(llvm::ArrayRef<ExprAST*>(NewArgs))), false};
+	}
+
+	public:
+	// simplify Fn's body, adding the nodes it needs to Fn's arena
+	void run(FunctionAST& Fn) {
+		ASTArena& Arena = Fn.getArena();
+		// each entry is a node and the index of its next operand to simplify;
+		// the operands simplified so far are on Results
+		llvm::SmallVector<std::pair<ExprAST*, unsigned>, 32> Stack;
+		llvm::SmallVector<Result, 32> Results;
+		Stack.push_back(std::make_pair(Fn.getBody(), 0u));
+		while (!Stack.empty()) {
+			ExprAST* N = Stack.back().first;
+			unsigned Child = Stack.back().second++;
+			ExprAST* Next = nullptr;
+			Result R = {N, true};
+			switch (N->getKind()) {
+			case ExprAST::EK_Number: {
+				auto Num = llvm::cast<NumberExprAST>(N);
+				R.E = getNumber(Arena, Num->getVal(), Num);
+				break;
+			}
+			case ExprAST::EK_Variable: {
+				auto V = llvm::cast<VariableExprAST>(N);
+				VariableExprAST*& Canonical = Variables[V->getName()];
+				if (!Canonical)
+					Canonical = V;
+				else if (Canonical != V)
+					instrument::count(instrument::C_ExprsShared);
+				R.E = Canonical;
+				break;
+			}
+			case ExprAST::EK_Binary: {
+				auto B = llvm::cast<BinaryExprAST>(N);
+				if (Child == 0)
+					Next = B->getLHS();
+				else if (Child == 1)
+					Next = B->getRHS();
+				else {
+					Result RHS = Results.pop_back_val();
+					Result LHS = Results.pop_back_val();
+					R = simplifyBinary(Arena, B, LHS, RHS);
+				}
+				break;
+			}
+			case ExprAST::EK_Call: {
+				auto C = llvm::cast<CallExprAST>(N);
+				size_t NumArgs = C->getArgs().size();
+				if (Child < NumArgs)
+					Next = C->getArgs()[Child];
+				else {
+					R = simplifyCall(Arena, C,
+						llvm::makeArrayRef(Results).take_back(NumArgs));
+					Results.truncate(Results.size() - NumArgs);
+				}
+				break;
+			}
+			}
+			if (Next)
+				Stack.push_back(std::make_pair(Next, 0u));
+			else {
+				Stack.pop_back();
+				Results.push_back(R);
+			}
+		}
+		Fn.setBody(Results.back().E);
+		Numbers.clear();
+		Variables.clear();
+		for (auto& B : Binaries)
+			B.clear();
+	}
+};
+
+#endif
@@ -0,0 +1,236 @@
+#ifndef KALEIDOSCOPE_SOURCE_BUFFER_HPP
+#define KALEIDOSCOPE_SOURCE_BUFFER_HPP
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// SourceBuffer -- the characters the lexer walks over.
+//
+// A regular file (named on the command line, or redirected into stdin) is
+// mmap'd whole. Anything else (a pipe, a terminal) is read in large chunks
+// and appended to a heap buffer as the lexer runs out of input, so the
+// "ready>" REPL still sees one line at a time.
+//
+// The bytes in [begin(), end()) are followed by Padding NUL bytes which may
+// be read but are not part of the input: the first terminates any scan,
+// and the rest let vectorized scanners load whole blocks past it.
+//
+// Token offsets into the buffer are 32 bits, so inputs are limited to 4GB.
+//
+// Streamed input can also be told to discard what has been lexed, keeping
+// memory bounded however long the stream is. Offsets still count from the
+// start of the input (modulo 4GB), so use offsetOf() and at() rather than
+// begin() to convert between offsets and pointers.
+class SourceBuffer {
+	public:
+	static const size_t Padding = 64;
+	static const size_t MaxSize = UINT32_MAX;
+
+	~SourceBuffer() {
+		if (Mapped)
+			munmap(Data, Capacity);
+		else
+			free(Data);
+		if (Fd > 0)
+			close(Fd);
+	}
+
+	// open a named file; returns nullptr (with errno set) on failure
+	static std::unique_ptr<SourceBuffer> openFile(const char* Path) {
+		int Fd = open(Path, O_RDONLY);
+		if (Fd < 0)
+			return nullptr;
+		auto Buf = openFd(Fd);
+		if (!Buf)
+			close(Fd);
+		return Buf;
+	}
+
+	static std::unique_ptr<SourceBuffer> openStdin() {
+		return openFd(STDIN_FILENO);
+	}
+
+	// a copy of Text, which can be edited with replace(); returns nullptr
+	// (with errno set) on failure
+	static std::unique_ptr<SourceBuffer> fromString(const char* Text,
+			size_t Len) {
+		std::unique_ptr<SourceBuffer> Buf(new SourceBuffer());
+		Buf->AtEOF = true;
+		if (!Buf->replace(0, 0, Text, Len))
+			return nullptr;
+		return Buf;
+	}
+
+	// the input that is still held
+	const char* begin() const { return Data; }
+	const char* end() const { return Data + Size; }
+	size_t size() const { return Size; }
+
+	// an offset in the input and the byte there, which must still be held
+	uint32_t offsetOf(const char* P) const { return uint32_t(Base + (P - Data)); }
+	const char* at(uint32_t Offset) const {
+		return Data + uint32_t(Offset - uint32_t(Base));
+	}
+
+	// let refill() drop input before the point it is told is still needed
+	void setDiscard(bool On) { Discard = On; }
+
+	// call Hook just before reading more streamed input, which may block,
+	// and before the input that has been lexed is discarded
+	void setReadHook(std::function<void()> Hook) { ReadHook = std::move(Hook); }
+
+	// true if the input comes from a terminal
+	bool isInteractive() const { return Interactive; }
+
+	// make more input available after end(). The buffer may move, so Ptr
+	// (which must point into [begin(), end()]) is rebased. With discarding,
+	// the input before Keep (by default Ptr) is dropped. Returns false once
+	// the input is exhausted.
+	bool refill(const char*& Ptr, const char* Keep = nullptr) {
+		if (Mapped || AtEOF)
+			return false;
+
+		if (ReadHook)
+			ReadHook();
+		if (Discard) {
+			size_t Drop = (Keep ? Keep : Ptr) - Data;
+			memmove(Data, Data + Drop, Size - Drop);
+			Size -= Drop;
+			Base += Drop;
+			memset(Data + Size, 0, Padding);
+			Ptr -= Drop;
+		}
+
+		size_t Off = Ptr - Data;
+		if (Size + ChunkSize > MaxSize) {
+			AtEOF = true;
+			return false;
+		}
+		if (Capacity - Size < ChunkSize + Padding) {
+			size_t NewCapacity = Capacity ? Capacity * 2 : ChunkSize + Padding;
+			while (NewCapacity - Size < ChunkSize + Padding)
+				NewCapacity *= 2;
+			char* NewData = static_cast<char*>(realloc(Data, NewCapacity));
+			if (!NewData) {
+				AtEOF = true;
+				return false;
+			}
+			Data = NewData;
+			Capacity = NewCapacity;
+		}
+
+		ssize_t N;
+		do
+			N = read(Fd, Data + Size, ChunkSize);
+		while (N < 0 && errno == EINTR);
+		Ptr = Data + Off;
+		if (N <= 0) {
+			AtEOF = true;
+			return false;
+		}
+		Size += N;
+		memset(Data + Size, 0, Padding);
+		return true;
+	}
+
+	// replace Length bytes at Offset with Text. Only for buffers made by
+	// fromString(). The buffer may move. Returns false (with errno set, and
+	// the buffer unchanged) on failure.
+	bool replace(size_t Offset, size_t Length, const char* Text,
+			size_t TextLen) {
+		size_t NewSize = Size - Length + TextLen;
+		if (NewSize > MaxSize) {
+			errno = EFBIG;
+			return false;
+		}
+		if (Capacity < NewSize + Padding) {
+			size_t NewCapacity = Capacity ? Capacity * 2 : ChunkSize + Padding;
+			while (NewCapacity < NewSize + Padding)
+				NewCapacity *= 2;
+			char* NewData = static_cast<char*>(realloc(Data, NewCapacity));
+			if (!NewData)
+				return false;
+			Data = NewData;
+			Capacity = NewCapacity;
+		}
+		memmove(Data + Offset + TextLen, Data + Offset + Length,
+			Size - Offset - Length);
+		memcpy(Data + Offset, Text, TextLen);
+		Size = NewSize;
+		memset(Data + Size, 0, Padding);
+		return true;
+	}
+
+	private:
+	// read size for streamed input; a terminal returns at most one line
+	static const size_t ChunkSize = 64 * 1024;
+
+	char* Data = nullptr;
+	size_t Size = 0;
+	size_t Capacity = 0;
+	uint64_t Base = 0;  // the offset of Data in the input
+	bool Discard = false;
+	std::function<void()> ReadHook;
+	int Fd = -1;
+	bool Mapped = false;
+	bool Interactive = false;
+	bool AtEOF = false;
+
+	SourceBuffer() = default;
+
+	static std::unique_ptr<SourceBuffer> openFd(int Fd) {
+		std::unique_ptr<SourceBuffer> Buf(new SourceBuffer());
+		Buf->Fd = Fd;
+
+		struct stat St;
+		if (fstat(Fd, &St) == 0 && S_ISREG(St.st_mode)) {
+			if (uint64_t(St.st_size) > MaxSize) {
+				errno = EFBIG;
+				return nullptr;
+			}
+			if (Buf->map(St.st_size))
+				return Buf;
+		}
+
+		Buf->Interactive = isatty(Fd);
+		Buf->Data = static_cast<char*>(calloc(1, Padding));
+		if (!Buf->Data)
+			return nullptr;
+		Buf->Capacity = Padding;
+		return Buf;
+	}
+
+	// map the whole file, followed by at least Padding zero bytes. An
+	// anonymous mapping is reserved first and the file mapped over its
+	// start, so the padding exists even when the file ends on a page
+	// boundary.
+	bool map(size_t FileSize) {
+		size_t PageSize = sysconf(_SC_PAGESIZE);
+		size_t Len = (FileSize + Padding + PageSize - 1) / PageSize * PageSize;
+		void* Base = mmap(nullptr, Len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0);
+		if (Base == MAP_FAILED)
+			return false;
+		if (FileSize && mmap(Base, FileSize, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+				Fd, 0) == MAP_FAILED) {
+			munmap(Base, Len);
+			return false;
+		}
+		madvise(Base, Len, MADV_SEQUENTIAL);
+		Data = static_cast<char*>(Base);
+		Size = FileSize;
+		Capacity = Len;
+		Mapped = true;
+		return true;
+	}
+};
+
+#endif
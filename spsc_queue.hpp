@@ -0,0 +1,106 @@
+#ifndef KALEIDOSCOPE_SPSC_QUEUE_HPP
+#define KALEIDOSCOPE_SPSC_QUEUE_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+// SPSCQueue -- a bounded ring buffer between one producer thread and one
+// consumer thread.
+//
+// Pushing and popping are lock-free while the ring is neither full nor
+// empty. A thread that finds it so spins briefly, then sleeps until the
+// other side moves; the lock is only taken to sleep and to wake a sleeper.
+template <typename T>
+class SPSCQueue {
+	std::unique_ptr<T[]> Slots;
+	const size_t Mask;
+
+	// Head is only written by the consumer and Tail by the producer; they
+	// count up forever, and are reduced modulo the capacity to index Slots
+	alignas(64) std::atomic<size_t> Head;
+	alignas(64) std::atomic<size_t> Tail;
+	alignas(64) std::atomic<bool> Closed;
+	// set while that side is, or is about to be, waiting
+	std::atomic<bool> ProducerSleeping, ConsumerSleeping;
+
+	std::mutex Lock;
+	std::condition_variable Moved;
+
+	static const unsigned SpinCount = 256;
+
+	// wait until Ready() holds. A sleeper announces itself before checking
+	// Ready() again, and the other side publishes its move before checking
+	// for sleepers, so (with both sequentially consistent) one of them sees
+	// the other and no wakeup is lost.
+	template <typename Pred>
+	void waitUntil(std::atomic<bool>& Sleeping, Pred Ready) {
+		for (unsigned I = 0; I != SpinCount; ++I) {
+			if (Ready())
+				return;
+			std::this_thread::yield();
+		}
+		std::unique_lock<std::mutex> L(Lock);
+		Sleeping = true;
+		Moved.wait(L, Ready);
+		Sleeping = false;
+	}
+
+	void wake(std::atomic<bool>& Sleeping) {
+		if (Sleeping) {
+			std::lock_guard<std::mutex> L(Lock);
+			Moved.notify_all();
+		}
+	}
+
+	public:
+	// Capacity is rounded up to a power of two
+	explicit SPSCQueue(size_t Capacity)
+		: Mask(roundUp(Capacity) - 1), Head(0), Tail(0), Closed(false),
+		ProducerSleeping(false), ConsumerSleeping(false) {
+		Slots.reset(new T[Mask + 1]);
+	}
+
+	static size_t roundUp(size_t N) {
+		size_t P = 1;
+		while (P < N)
+			P *= 2;
+		return P;
+	}
+
+	// producer: add V, waiting while the ring is full
+	void push(T V) {
+		size_t T0 = Tail.load(std::memory_order_relaxed);
+		waitUntil(ProducerSleeping, [&] { return T0 - Head.load() <= Mask; });
+		Slots[T0 & Mask] = std::move(V);
+		Tail = T0 + 1;
+		wake(ConsumerSleeping);
+	}
+
+	// producer: there will be no more pushes
+	void close() {
+		Closed = true;
+		std::lock_guard<std::mutex> L(Lock);
+		Moved.notify_all();
+	}
+
+	// consumer: take the oldest element, waiting while the ring is empty.
+	// Returns false once the ring is empty and closed.
+	bool pop(T& V) {
+		size_t H0 = Head.load(std::memory_order_relaxed);
+		waitUntil(ConsumerSleeping,
+			[&] { return Tail.load() != H0 || Closed.load(); });
+		if (Tail.load() == H0)
+			return false;
+		V = std::move(Slots[H0 & Mask]);
+		Head = H0 + 1;
+		wake(ProducerSleeping);
+		return true;
+	}
+};
+
+#endif
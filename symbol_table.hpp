@@ -0,0 +1,77 @@
+#ifndef KALEIDOSCOPE_SYMBOL_TABLE_HPP
+#define KALEIDOSCOPE_SYMBOL_TABLE_HPP
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include <cstdint>
+#include <initializer_list>
+#include <mutex>
+#include <vector>
+
+// a dense identifier handle; IDs are handed out in order from 0, so they
+// can index side tables directly
+typedef uint32_t SymbolID;
+
+// the names with fixed IDs: the keywords, so the lexer can recognize them
+// by ID, and the names the parser makes up
+enum : SymbolID {
+	sym_def,
+	sym_extern,
+	sym_anon_expr
+};
+
+// SymbolTable -- maps each distinct identifier to a SymbolID, once. Two
+// names are equal exactly when their IDs are.
+//
+// A table is used from one thread at a time, unless it is made shared, in
+// which case intern() and getName() take a lock.
+class SymbolTable {
+	llvm::StringMap<SymbolID, llvm::BumpPtrAllocator> Map;
+	std::vector<llvm::StringRef> Names;  // indexed by SymbolID
+	bool Shared = false;
+	mutable std::mutex Lock;
+
+	SymbolID internUnlocked(llvm::StringRef Name) {
+		auto R = Map.insert(std::make_pair(Name, SymbolID(Names.size())));
+		if (R.second)
+			Names.push_back(R.first->getKey());
+		return R.first->second;
+	}
+
+	public:
+	SymbolTable() : SymbolTable({"def", "extern", "__anon_expr"}) {}
+
+	// the Reserved names get IDs 0, 1, ... in the order given
+	SymbolTable(std::initializer_list<llvm::StringRef> Reserved) {
+		for (llvm::StringRef Name : Reserved)
+			intern(Name);
+	}
+
+	// let other threads use the table while this one does; must be called
+	// before they start
+	void setShared(bool On) { Shared = On; }
+
+	SymbolID intern(llvm::StringRef Name) {
+		if (!Shared)
+			return internUnlocked(Name);
+		std::lock_guard<std::mutex> L(Lock);
+		return internUnlocked(Name);
+	}
+
+	llvm::StringRef getName(SymbolID ID) const {
+		if (!Shared)
+			return Names[ID];
+		std::lock_guard<std::mutex> L(Lock);
+		return Names[ID];
+	}
+
+	size_t size() const {
+		if (!Shared)
+			return Names.size();
+		std::lock_guard<std::mutex> L(Lock);
+		return Names.size();
+	}
+};
+
+#endif
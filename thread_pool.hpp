@@ -0,0 +1,80 @@
+#ifndef KALEIDOSCOPE_THREAD_POOL_HPP
+#define KALEIDOSCOPE_THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// ThreadPool -- a fixed set of worker threads running queued tasks.
+// Tasks must not throw.
+class ThreadPool {
+	std::vector<std::thread> Workers;
+	std::deque<std::function<void()>> Queue;
+	std::mutex Lock;
+	std::condition_variable WorkAvailable;  // signalled on async() and exit
+	std::condition_variable AllDone;  // signalled when Active drops to 0
+	unsigned Active = 0;  // tasks queued or running
+	bool Exiting = false;
+
+	void work() {
+		std::unique_lock<std::mutex> L(Lock);
+		while (true) {
+			WorkAvailable.wait(L, [this] { return Exiting || !Queue.empty(); });
+			if (Queue.empty())
+				return;
+			std::function<void()> Task = std::move(Queue.front());
+			Queue.pop_front();
+			L.unlock();
+			Task();
+			L.lock();
+			if (--Active == 0)
+				AllDone.notify_all();
+		}
+	}
+
+	public:
+	// 0 threads means one per hardware thread
+	explicit ThreadPool(unsigned Threads = 0) {
+		if (!Threads)
+			Threads = defaultThreadCount();
+		for (unsigned I = 0; I != Threads; ++I)
+			Workers.emplace_back([this] { work(); });
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> L(Lock);
+			Exiting = true;
+		}
+		WorkAvailable.notify_all();
+		for (std::thread& T : Workers)
+			T.join();
+	}
+
+	static unsigned defaultThreadCount() {
+		unsigned N = std::thread::hardware_concurrency();
+		return N ? N : 1;
+	}
+
+	unsigned size() const { return Workers.size(); }
+
+	void async(std::function<void()> Task) {
+		{
+			std::lock_guard<std::mutex> L(Lock);
+			Queue.push_back(std::move(Task));
+			++Active;
+		}
+		WorkAvailable.notify_one();
+	}
+
+	// block until every task queued so far has finished
+	void wait() {
+		std::unique_lock<std::mutex> L(Lock);
+		AllDone.wait(L, [this] { return Active == 0; });
+	}
+};
+
+#endif
@@ -1,11 +1,28 @@
-#include "llvm/ADT/STLExtras.h"
+#include "ast.hpp"
+#include "ast_cache.hpp"
+#include "diagnostics.hpp"
+#include "flat_ast.hpp"
+#include "incremental.hpp"
+#include "instrument.hpp"
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "pipeline.hpp"
+#include "source_buffer.hpp"
+#include "symbol_table.hpp"
+#include "thread_pool.hpp"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
 #include <algorithm>
-#include <cctype>
-#include <cstdio>
-#include <cstdlib>
-#include <map>
+#include <cerrno>
+#include <cstring>
 #include <memory>
 #include <string>
+#include <system_error>
+#include <tuple>
 #include <vector>
 
 /*
@@ -58,384 +75,469 @@
 	ready> ^D
 */
 
-//  lexer
-enum Token {
-	tok_eof = -1,
-	tok_def = -2,
-	tok_extern = -3,
-	tok_identifier = -4,
-	tok_number = -5
-};
-
-static std::string IdentifierStr;  // filled in if tok_identifier
-static double NumVal;  // filled in if tok_number
-
-// return the next token from standard input
-static int gettok() {
-	static int LastChar = ' ';
-
-	while (isspace(LastChar)) // skip any whitespace
-		LastChar = getchar(); // get next char
-
-	if (isalpha(LastChar)) {  // identifier: [a-zA-Z][a-zA-Z0-9]*
-		IdentifierStr = LastChar;
-		while (isalnum((LastChar = getchar())))
-			IdentifierStr += LastChar;
-
-	    if (IdentifierStr == "def")
-	    	return tok_def;
-	    if (IdentifierStr == "extern")
-	    	return tok_extern;
-	    return tok_identifier;
-	}
-
-	if (isdigit(LastChar) || LastChar == '.') {  // Number: [0-9.]+
-		std::string NumStr;
-		do {
-			NumStr += LastChar;
-			LastChar = getchar();
-		} while (isdigit(LastChar) || LastChar == '.');
-		NumVal = strtod(NumStr.c_str(), nullptr);
-		return tok_number;
-	}
-
-	if (LastChar == '#') { // comment until end of line
-		do
-			LastChar = getchar();
-		while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
-		if (LastChar != EOF)
-			return gettok();
-	}
-
-	// check for end of file. Don't eat the EOF.
-	if (LastChar == EOF)
-		return tok_eof;
-
-	// otherwise just return the character as its ascii value
-	int ThisChar = LastChar;
-	LastChar = getchar();
-	return ThisChar;
-}
 
+// ======   top level parsing
+static llvm::cl::opt<bool> IterativeParse("iterative-parse",
+	llvm::cl::desc("Parse expressions with an explicit stack instead of "
+		"recursion"));
 
-// AST
-
-namespace {
-
-	// base class for all expression nodes
-	class ExprAST {
-		public:
-			virtual ~ExprAST() = default;
-	};
-
-	// expression class for numeric literals like "1.0"
-	class NumberExprAST : public ExprAST {
-		double Val;
-		public:
-		NumberExprAST(double Val) : Val(Val) {}
-	};
-
-	// expression class for referencing a variable, like "a"
-	class VariableExprAST : public ExprAST {
-		std::string Name;
-		public:
-		VariableExprAST(const std::string& Name) : Name(Name) {}
-	};
-
-	// expression class for a binary operator
-	class BinaryExprAST : public ExprAST {
-		char Op;
-		std::unique_ptr<ExprAST> LHS, RHS;
-		public:
-		BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
-				std::unique_ptr<ExprAST> RHS)
-			: Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-	};
-
-	// expression class for function calls
-	class CallExprAST : public ExprAST {
-		std::string Callee;
-		std::vector<std::unique_ptr<ExprAST>> Args;
-		public:
-		CallExprAST(const std::string& Callee,
-				std::vector<std::unique_ptr<ExprAST>> Args)
-			: Callee(Callee), Args(std::move(Args)) {}
-	};
-
-	// represents the "prototype" of a function, which captures its
-	// name, and its argument names (thus implicitly the number of
-	// arguments the function takes).
-	class PrototypeAST {
-		std::string Name;
-		std::vector<std::string> Args;
-		public:
-		PrototypeAST(const std::string& Name, std::vector<std::string> Args)
-			: Name(Name), Args(std::move(Args)) {}
-		const std::string& getName() const { return Name; }
-	};
-
-	// represents a function definition itself
-	class FunctionAST {
-		std::unique_ptr<PrototypeAST> Proto;
-		std::unique_ptr<ExprAST> Body;
-		public:
-		FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-				std::unique_ptr<ExprAST> Body)
-			: Proto(std::move(Proto)), Body(std::move(Body)) {}
-	};
-
-} // end namespace
-
-// ===============================
-//       parser
-// ===============================
-
-// CurTok/getNextToken -- Provide a simple token buffer. CurTok is the
-// current token the parser is looking at. getNextToken reads another 
-// token from the lexer and updates CurTok with its results.
-static int CurTok;
-static int getNextToken() { return CurTok = gettok(); }
-
-// holds the precedence for each binary operator that is defined
-static std::map<char,int> BinopPrecedence;
-
-// get the precedence of the pending binary operator token
-static int GetTokPrecedence() {
-	if (!isascii(CurTok))
-		return -1;
-
-	// make sure it's a declared binop
-	int TokPrec = BinopPrecedence[CurTok];
-	if (TokPrec <= 0)
-		return -1;
-	return TokPrec;
-}
+static llvm::cl::opt<bool> DumpAST("dump-ast",
+	llvm::cl::desc("Print each parsed item to stdout as an s-expression"));
 
-std::unique_ptr<ExprAST> LogError(const char* Str) {
-	fprintf(stderr, "Error: %s\n", Str);
-	return nullptr;
-}
+static llvm::cl::opt<bool> UseFlatAST("flat-ast",
+	llvm::cl::desc("Also store each parsed body in the flat AST encoding, "
+		"and print -dump-ast output from there"));
 
-std::unique_ptr<PrototypeAST> LogErrorP(const char* Str) {
-	LogError(Str);
-	return nullptr;
-}
+static llvm::cl::opt<bool> BatchMode("batch",
+	llvm::cl::desc("Print no prompts and no report per item; print the "
+		"diagnostics all at once at the end, with a summary. The default "
+		"unless the input is a terminal"));
 
-static std::unique_ptr<ExprAST> ParseExpression();
+// BatchMode, or its default
+static bool Batch = false;
 
-// numberexpr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-	auto Result = llvm::make_unique<NumberExprAST>(NumVal);
-	getNextToken();
-	return std::move(Result);
+// print MainLoop's prompt, unless in batch mode
+static void prompt(llvm::raw_ostream& OS) {
+	if (!Batch)
+		OS << "ready> ";
 }
 
-// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr() {
-	getNextToken();
-	auto V = ParseExpression();
-	if (!V)
-		return nullptr;
-	if (CurTok != ')')
-		return LogError("expected ')'");
-	getNextToken();
-	return V;
+static llvm::cl::opt<bool> ErrorLocations("error-locations",
+	llvm::cl::desc("Give the line and column of each error (not with "
+		"-pipeline or -edits)"),
+	llvm::cl::init(true));
+
+static llvm::cl::opt<unsigned> MaxErrors("max-errors",
+	llvm::cl::desc("Stop printing errors after this many; 0 for no limit"),
+	llvm::cl::init(0));
+
+static llvm::cl::opt<bool> DedupeErrors("dedupe-errors",
+	llvm::cl::desc("Drop an error that repeats the one before it on the "
+		"same line"));
+
+// set up a parser for this language: the standard binary operators
+static void configure(Parser& P) {
+	P.setBinopPrecedence('<', 10);
+	P.setBinopPrecedence('+', 20);
+	P.setBinopPrecedence('-', 20);
+	P.setBinopPrecedence('*', 40); // highest
+	P.setIterative(IterativeParse);
+	P.setReportItems(!Batch);
+	P.getDiags().setMaxErrors(MaxErrors);
+	P.getDiags().setDeduplicate(DedupeErrors);
 }
 
-//  identifierexpr
-//    ::= identifier
-//    ::= identifier '(' expression* ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-	std::string IdName = IdentifierStr;
-	getNextToken();  // eat identifier
-
-	if (CurTok != '(')  // simple variable ref.
-		return llvm::make_unique<VariableExprAST>(IdName);
+// TopLevelHandler -- drives a Parser over top-level items, which report
+// themselves to the parser's error stream (and with -dump-ast, are printed
+// to Dump).
+class TopLevelHandler {
+	Parser& P;
+	const SymbolTable& Symbols;
+	llvm::raw_ostream& Dump;
+	FlatAST Flat;  // with -flat-ast, every item parsed so far
+	ParseSummary Summary;
+
+	public:
+	// set when error recovery has to skip the token at the end of the range
+	// being parsed; see ParallelMainLoop
+	bool RecoveredAtEnd = false;
+
+	TopLevelHandler(Parser& P, const SymbolTable& Symbols,
+			llvm::raw_ostream& Dump)
+		: P(P), Symbols(Symbols), Dump(Dump) {}
+
+	// with -flat-ast, everything parsed so far
+	const FlatAST& getFlatAST() const { return Flat; }
+	const ParseSummary& getSummary() const { return Summary; }
+
+	void HandleTopLevelItem() {
+		instrument::ScopedTimer Timer(P.getCurTok() == tok_def
+			? instrument::T_HandleDefinition : P.getCurTok() == tok_extern
+			? instrument::T_HandleExtern : instrument::T_HandleTopLevelExpression);
+		TopLevelItem Item = P.ParseTopLevelItem();
+		RecoveredAtEnd |= Item.RecoveredAtEnd;
+		Summary.add(Item);
+		if (Item.failed() || Item.Kind == TopLevelItem::TK_Semicolon)
+			return;
+		// with -flat-ast, record the item, and print it from there
+		if (UseFlatAST) {
+			const FlatItem& Flattened = Flat.addItem(Item);
+			if (DumpAST)
+				printItem(Dump, Symbols, Flat.view(), Flattened);
+		}
+		else if (DumpAST)
+			printItem(Dump, Symbols, Item);
+	}
 
-	// call
-	getNextToken(); // eat (
-	std::vector<std::unique_ptr<ExprAST>> Args;
-	if (CurTok != ')') {
+	void MainLoop() {
 		while (true) {
-			if (auto Arg = ParseExpression())
-				Args.push_back(std::move(Arg));
-			else
-				return nullptr;
-
-			if (CurTok == ')')
-				break;
-
-			if (CurTok != ',')
-				return LogError("Expected ')' or ',' in argument list");
-			getNextToken();
+			prompt(P.errs());
+			if (P.getCurTok() == tok_eof)
+				return;
+			HandleTopLevelItem();
 		}
 	}
+};
 
-	getNextToken(); // eat ')'
-	return llvm::make_unique<CallExprAST>(IdName, std::move(Args));
-}
+// ======   parallel parsing
 
-// primary
-//   ::= identierexpr
-//   ::= numberexpr
-//   ::= parenexpr
-static std::unique_ptr<ExprAST> ParsePrimary() {
-	switch (CurTok) {
-	default:
-		return LogError("unknown token when expecting an expression");
-	case tok_identifier:
-		return ParseIdentifierExpr();
-	case tok_number:
-		return ParseNumberExpr();
-	case '(':
-		return ParseParenExpr();
-	}
-}
+// a run of whole top-level items, parsed by one task
+struct ParseChunk {
+	size_t Begin, End;  // token range
+	std::string Messages;
+	std::string Dump;
+	bool RecoveredAtEnd;
+	ParseSummary Summary;
+};
 
-// binoprhs
-//   ::= ('+' primary)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-	std::unique_ptr<ExprAST> LHS) {
-	while (true) {
-		int TokPrec = GetTokPrecedence();
-		if (TokPrec < ExprPrec)
-			return LHS;
-
-		int BinOp = CurTok;
-		getNextToken();
-
-		auto RHS = ParsePrimary();
-		if (!RHS) return nullptr;
-
-		int NextPrec = GetTokPrecedence();
-		if (TokPrec < NextPrec) {
-			RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
-			if (!RHS) return nullptr;
+// split Toks into chunks of at least MinTokens tokens. A chunk may only
+// end where a top-level item is bound to start: before a 'def' or an
+// 'extern', or after a ';'.
+static std::vector<ParseChunk> splitTopLevel(const TokenBuffer& Toks,
+		size_t MinTokens) {
+	std::vector<ParseChunk> Chunks;
+	size_t Last = Toks.size() - 1;  // the tok_eof
+	size_t Begin = 0;
+	for (size_t I = 1; I < Last; ++I) {
+		int Kind = Toks.Kind[I];
+		bool ItemStart = Kind == tok_def || Kind == tok_extern ||
+			Toks.Kind[I - 1] == ';';
+		if (ItemStart && I - Begin >= MinTokens) {
+			Chunks.push_back(ParseChunk{Begin, I, "", "", false, ParseSummary()});
+			Begin = I;
 		}
-
-		LHS = llvm::make_unique<BinaryExprAST>(BinOp, std::move(LHS),
-			std::move(RHS));
 	}
+	Chunks.push_back(ParseChunk{Begin, Last, "", "", false, ParseSummary()});
+	return Chunks;
 }
 
-// expression 
-//   ::= primary binoprhs
-static std::unique_ptr<ExprAST> ParseExpression() {
-	auto LHS = ParsePrimary();
-	if (!LHS) return nullptr;
-	return ParseBinOpRHS(0, std::move(LHS));
+// parse the items in C, buffering everything they print
+static void parseChunk(const TokenBuffer& Toks, const SymbolTable& Symbols,
+		LineIndex* Lines, ParseChunk& C) {
+	llvm::raw_string_ostream Messages(C.Messages), Dump(C.Dump);
+	DiagnosticEngine Diags(Messages, nullptr, Lines);
+	Parser P(Toks, C.Begin, C.End, Diags);
+	configure(P);
+	TopLevelHandler H(P, Symbols, Dump);
+
+	P.getNextToken();
+	while (P.getCurTok() != tok_eof) {
+		prompt(Messages);
+		H.HandleTopLevelItem();
+	}
+	C.RecoveredAtEnd = H.RecoveredAtEnd;
+	C.Summary = H.getSummary();
 }
 
-// prototype
-//   ::= id '(' id* ')'
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
-	if (CurTok != tok_identifier)
-		return LogErrorP("Expected function name in prototype");
-	std::string FnName = IdentifierStr;
-	getNextToken();
-
-	if (CurTok != '(')
-		return LogErrorP("Expected '(' in prototype");
-
-	std::vector<std::string> ArgNames;
-	while (getNextToken() == tok_identifier)
-		ArgNames.push_back(IdentifierStr);
-	if (CurTok != ')')
-		return LogErrorP("Expected ')' in prototype");
-
-	getNextToken();
-	return llvm::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
-}
+// MainLoop over a pre-lexed input, with the chunks parsed on a thread pool
+// and their messages printed to Diags' stream in source order. The output is
+// exactly what MainLoop prints. Returns the summary of the whole parse.
+//
+// On valid input every chunk boundary is also an item boundary of the
+// serial parse. The exception is a chunk whose last item fails right at
+// the chunk's end: a serial parse would then skip the next chunk's first
+// token to recover. After such a chunk, parsing continues serially until
+// an item starts on a chunk boundary again.
+static ParseSummary ParallelMainLoop(const TokenBuffer& Toks,
+		const SymbolTable& Symbols, unsigned Threads, DiagnosticEngine& Diags) {
+	llvm::raw_ostream& Errs = Diags.getStream();
+	size_t Last = Toks.size() - 1;
+	std::vector<ParseChunk> Chunks = splitTopLevel(Toks,
+		std::max<size_t>(1024, Last / (Threads * 8)));
+	{
+		ThreadPool Pool(Threads);
+		for (ParseChunk& C : Chunks)
+			Pool.async([&Toks, &Symbols, &Diags, &C] {
+				parseChunk(Toks, Symbols, Diags.getLineIndex(), C);
+			});
+		Pool.wait();
+	}
 
-// defintion
-//   ::= 'def' prototype expression
-static std::unique_ptr<FunctionAST> ParseDefinition() {
-	getNextToken();
-	auto Proto = ParsePrototype();
-	if (!Proto) return nullptr;
-	if (auto E = ParseExpression())
-		return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-	return nullptr;
-}
+	Parser P(Toks, 0, Last, Diags);
+	configure(P);
+	TopLevelHandler H(P, Symbols, llvm::outs());
+	ParseSummary Summary;
+	for (size_t K = 0; K < Chunks.size();) {
+		Errs << Chunks[K].Messages;
+		llvm::outs() << Chunks[K].Dump;
+		Summary += Chunks[K].Summary;
+		if (!Chunks[K].RecoveredAtEnd || Chunks[K].End == Last) {
+			++K;
+			continue;
+		}
 
-// toplevelexpr
-//   ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-	if (auto E = ParseExpression()) {
-		auto Proto = llvm::make_unique<PrototypeAST>("__anon_expr",
-			std::vector<std::string>());
-		return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+		// skip the token that the failed item ran into, reporting it if it
+		// is a lexical error, as the serial parse would
+		P.seek(Chunks[K].End);
+		P.getNextToken();
+		size_t J = K + 1;
+		while (P.getCurTok() != tok_eof) {
+			size_t ItemStart = P.getTokenIndex();
+			while (J < Chunks.size() && Chunks[J].Begin < ItemStart)
+				++J;
+			if (J < Chunks.size() && Chunks[J].Begin == ItemStart)
+				break;
+			prompt(Errs);
+			H.HandleTopLevelItem();
+		}
+		K = P.getCurTok() == tok_eof ? Chunks.size() : J;
 	}
-	return nullptr;
+	prompt(Errs);
+	Summary += H.getSummary();
+	return Summary;
 }
 
-// external 
-//   ::= 'extern' prototype
-static std::unique_ptr<PrototypeAST> ParseExtern() {
-	getNextToken();
-	return ParsePrototype();
+static llvm::cl::opt<std::string> InputFilename(llvm::cl::Positional,
+	llvm::cl::desc("<input file>"), llvm::cl::init("-"));
+
+static llvm::cl::opt<bool> PreLex("prelex",
+	llvm::cl::desc("Lex the whole input into a token buffer before parsing"));
+
+static llvm::cl::opt<unsigned> ParseThreads("parse-threads",
+	llvm::cl::desc("Parse top-level items on this many threads; 0 means one "
+		"per core (implies -prelex)"),
+	llvm::cl::init(1));
+
+static llvm::cl::opt<std::string> ASTCacheDir("ast-cache",
+	llvm::cl::desc("Reuse the parse of an unchanged input file from this "
+		"directory, and save new parses there (implies -flat-ast)"),
+	llvm::cl::value_desc("dir"));
+
+// ======   incremental parsing
+static llvm::cl::opt<std::string> EditsFilename("edits",
+	llvm::cl::desc("Parse the input incrementally, then apply the edits in "
+		"this file one at a time; the output is for the edited text. Each "
+		"line is '<offset> <length> <text>', with \\n, \\t and \\\\ "
+		"escapes in the text"),
+	llvm::cl::value_desc("file"));
+
+// undo the escapes in an edit's text
+static std::string unescape(llvm::StringRef Text) {
+	std::string Out;
+	for (size_t I = 0; I != Text.size(); ++I) {
+		char C = Text[I];
+		if (C == '\\' && I + 1 != Text.size()) {
+			C = Text[++I];
+			C = C == 'n' ? '\n' : C == 't' ? '\t' : C;
+		}
+		Out += C;
+	}
+	return Out;
 }
 
-// ======   top level parsing
-static void HandleDefinition() {
-	if (ParseDefinition()) {
-		fprintf(stderr, "Parsed a function definition.\n");
+// parse Source into an IncrementalParser, apply each edit in EditsFilename,
+// and print what MainLoop would print for the result
+static int runEdits(SourceBuffer& Source) {
+	const char* End = Source.end();
+	while (Source.refill(End))
+		End = Source.end();
+
+	std::unique_ptr<SourceBuffer> Edits =
+		SourceBuffer::openFile(EditsFilename.c_str());
+	std::unique_ptr<SourceBuffer> Text =
+		SourceBuffer::fromString(Source.begin(), Source.size());
+	if (!Edits || !Text) {
+		llvm::errs() << "Error: cannot open '" << EditsFilename << "': "
+			<< strerror(errno) << '\n';
+		return 1;
 	}
-	else {
-		getNextToken();
+	IncrementalParser IP(std::move(Text), configure);
+
+	llvm::SmallVector<llvm::StringRef, 16> Lines;
+	llvm::StringRef(Edits->begin(), Edits->size()).split(Lines, '\n', -1,
+		/*KeepEmpty=*/false);
+	for (unsigned N = 0; N != Lines.size(); ++N) {
+		llvm::StringRef Line = Lines[N], OffsetText, LengthText;
+		std::tie(OffsetText, Line) = Line.split(' ');
+		std::tie(LengthText, Line) = Line.split(' ');
+		size_t Offset, Length;
+		if (OffsetText.getAsInteger(10, Offset) ||
+				LengthText.getAsInteger(10, Length) ||
+				!IP.edit(Offset, Length, unescape(Line))) {
+			llvm::errs() << "Error: cannot apply edit " << N + 1 << " ('"
+				<< Lines[N] << "')\n";
+			return 1;
+		}
 	}
-}
 
-static void HandleExtern() {
-	if (ParseExtern()) {
-		fprintf(stderr, "Parsed an extern\n");
+	IP.printMessages(llvm::errs(), !Batch);
+	if (DumpAST) {
+		for (const IncrementalParser::Item& I : IP.getItems())
+			printItem(llvm::outs(), IP.getSymbols(), I.Parsed);
 	}
-	else {
-		getNextToken();
+	if (Batch) {
+		ParseSummary Summary;
+		for (const IncrementalParser::Item& I : IP.getItems())
+			Summary.add(I.Parsed);
+		Summary.print(llvm::errs());
 	}
+	return 0;
 }
 
-static void HandleTopLevelExpression() {
-	if (ParseTopLevelExpr()) {
-		fprintf(stderr, "Parsed a top-level expr\n");
-	}
-	else {
-		getNextToken();
+// ======   pipelined parsing
+static llvm::cl::opt<bool> UsePipeline("pipeline",
+	llvm::cl::desc("Lex, parse and print on separate threads, in bounded "
+		"memory"));
+
+// MainLoop, with the lexing and parsing done by a Pipeline. In batch mode
+// the diagnostics are held until the end, with the summary.
+static void PipelineMainLoop(SourceBuffer& Source, SymbolTable& Symbols) {
+	Pipeline Pipe(Source, Symbols, configure);
+	Pipe.setPrompts(!Batch);
+	Pipe.setTrackLines(DedupeErrors);
+	std::string Diagnostics;
+	ParseSummary Summary;
+	Pipe.run([&](Pipeline::Output& Out) {
+		if (Batch)
+			Diagnostics += Out.Messages;
+		else
+			llvm::errs() << Out.Messages;
+		if (Out.Item)
+			Summary.add(*Out.Item);
+		if (DumpAST && Out.Item)
+			printItem(llvm::outs(), Symbols, *Out.Item);
+	});
+	if (Batch) {
+		llvm::errs() << Diagnostics;
+		Summary.print(llvm::errs());
 	}
 }
 
-static void MainLoop() {
-	while (true) {
-		fprintf(stderr, "ready> ");
-		switch (CurTok) {
-		case tok_eof:
+// ======   instrumentation
+static llvm::cl::opt<std::string> InstrumentOutput("instrument",
+	llvm::cl::desc("Write the front end's counters and timers to this file "
+		"('-' for stdout) at exit; needs a build with KS_INSTRUMENT"),
+	llvm::cl::value_desc("file"));
+
+static llvm::cl::opt<instrument::ReportFormat> InstrumentFormat(
+	"instrument-format", llvm::cl::desc("The format of the -instrument report"),
+	llvm::cl::values(
+		clEnumValN(instrument::RF_JSON, "json", "counter and timer totals"),
+		clEnumValN(instrument::RF_ChromeTrace, "trace",
+			"a Chrome trace of the timed regions, with the counter totals")),
+	llvm::cl::init(instrument::RF_JSON));
+
+// writes the -instrument report when main returns
+struct InstrumentReport {
+	~InstrumentReport() {
+		if (InstrumentOutput.empty())
+			return;
+		std::error_code EC;
+		llvm::raw_fd_ostream OS(InstrumentOutput, EC, llvm::sys::fs::OF_None);
+		if (EC) {
+			llvm::errs() << "Error: cannot open '" << InstrumentOutput << "': "
+				<< EC.message() << '\n';
 			return;
-		case ';':
-			getNextToken();
-			break;
-		case tok_def:
-			HandleDefinition();
-			break;
-		case tok_extern:
-			HandleExtern();
-			break;
-		default:
-			HandleTopLevelExpression();
-			break;
 		}
+		instrument::writeReport(OS, InstrumentFormat);
 	}
-}
+};
 
-int main()
+int main(int argc, char** argv)
 {
-	BinopPrecedence['<'] = 10;
-	BinopPrecedence['+'] = 20;
-	BinopPrecedence['-'] = 20;
-	BinopPrecedence['*'] = 40; // highest
+	llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope parser\n");
+	if (!InstrumentOutput.empty() && !instrument::Enabled) {
+		llvm::errs() << "Error: -instrument needs a build with KS_INSTRUMENT "
+			"(make INSTRUMENT=1)\n";
+		return 1;
+	}
+	InstrumentReport Report;
+	Batch = BatchMode.getNumOccurrences() ? bool(BatchMode)
+		: InputFilename != "-" || !llvm::sys::Process::StandardInIsUserInput();
+
+	std::unique_ptr<SourceBuffer> Source = InputFilename == "-"
+		? SourceBuffer::openStdin()
+		: SourceBuffer::openFile(InputFilename.c_str());
+	if (!Source) {
+		llvm::errs() << "Error: cannot open '" << InputFilename << "': "
+			<< strerror(errno) << '\n';
+		return 1;
+	}
+
+	if (!EditsFilename.empty())
+		return runEdits(*Source);
+
+	SymbolTable Symbols;
+	if (UsePipeline) {
+		PipelineMainLoop(*Source, Symbols);
+		return 0;
+	}
 
-	fprintf(stderr, "ready> ");
-	getNextToken();
+	unsigned Threads = ParseThreads ? unsigned(ParseThreads)
+		: ThreadPool::defaultThreadCount();
+	// capping or deduplicating the errors needs them in order, as they are
+	// reported
+	if (MaxErrors || DedupeErrors)
+		Threads = 1;
+
+	// with a cache, a hit replays the cached parse; a miss parses serially,
+	// keeping a transcript of the messages to save with the result. Batch
+	// mode keeps the transcript too, to print it all at once.
+	std::unique_ptr<ASTCache> Cache;
+	llvm::StringRef Text(Source->begin(), Source->size());
+	std::string Transcript;
+	llvm::raw_string_ostream TranscriptStream(Transcript);
+	if (!ASTCacheDir.empty() && InputFilename != "-") {
+		// the options the transcript depends on
+		std::string Variant;
+		llvm::raw_string_ostream(Variant) << "batch=" << Batch
+			<< " error-locations=" << ErrorLocations << " max-errors=" << MaxErrors
+			<< " dedupe-errors=" << DedupeErrors;
+		Cache = std::make_unique<ASTCache>(ASTCacheDir, Variant);
+		if (auto Hit = Cache->lookup(Text, Symbols)) {
+			const FlatASTView& AST = Hit->getAST();
+			llvm::errs() << Hit->getTranscript();
+			if (DumpAST) {
+				for (const FlatItem& Item : AST.items())
+					printItem(llvm::outs(), Symbols, AST, Item);
+			}
+			if (Batch) {
+				ParseSummary Summary;
+				for (const FlatItem& Item : AST.items())
+					Summary.add(Item.Kind == FlatItem::FI_Definition
+						? TopLevelItem::TK_Definition
+						: Item.Kind == FlatItem::FI_Extern ? TopLevelItem::TK_Extern
+						: TopLevelItem::TK_TopLevelExpr);
+				Summary.Errors = Hit->getNumFailed();
+				Summary.print(llvm::errs());
+			}
+			return 0;
+		}
+		UseFlatAST = true;
+		Threads = 1;
+	}
+	llvm::raw_ostream& Errs = Cache || Batch
+		? static_cast<llvm::raw_ostream&>(TranscriptStream) : llvm::errs();
+
+	LineIndex Lines(*Source);
+	DiagnosticEngine Diags(Errs, Source.get(), ErrorLocations ? &Lines : nullptr);
+	Lexer Lex(*Source, Symbols, Diags);
+
+	TokenBuffer Toks;
+	if (PreLex || Threads > 1)
+		Lex.lexAll(Toks);
+
+	prompt(Errs);
+	ParseSummary Summary;
+	if (Threads > 1)
+		Summary = ParallelMainLoop(Toks, Symbols, Threads, Diags);
+	else {
+		std::unique_ptr<Parser> P = PreLex
+			? std::make_unique<Parser>(Toks, 0, Toks.size() - 1, Diags)
+			: std::make_unique<Parser>(Lex, Diags);
+		configure(*P);
+		TopLevelHandler H(*P, Symbols, llvm::outs());
+		P->getNextToken();
+		H.MainLoop();
+		Summary = H.getSummary();
+		if (Cache)
+			Cache->store(Text, Symbols, H.getFlatAST().view(),
+				TranscriptStream.str(), Summary.Errors);
+	}
 
-	MainLoop();
+	if (Cache || Batch)
+		llvm::errs() << TranscriptStream.str();
+	if (Batch)
+		Summary.print(llvm::errs());
 	return 0;
 }
@@ -0,0 +1,747 @@
+#include "ast.hpp"
+#include "batch_executor.hpp"
+#include "codegen.hpp"
+#include "diagnostics.hpp"
+#include "extern_table.hpp"
+#include "instrument.hpp"
+#include "jit.hpp"
+#include "lexer.hpp"
+#include "object_cache.hpp"
+#include "optimizer.hpp"
+#include "parser.hpp"
+#include "simplify.hpp"
+#include "source_buffer.hpp"
+#include "symbol_table.hpp"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+/*
+  >>> code generation:
+
+	Every definition and extern is lowered to LLVM IR, and every top-level
+	expression is compiled and run (after the AST is simplified, unless
+	-simplify=false, see simplify.hpp):
+
+	ready> def foo(a b) a*a + 2*a*b + b*b;
+	ready> foo(3, 4);
+	Evaluated to 49.000000
+	ready> extern sin(x);
+	ready> sin(1) * sin(1);
+	Evaluated to 0.708073
+	ready> ^D
+
+	With -lazy, a definition is only checked when it is read: its IR is
+	generated, optimized and compiled when it is first called, so a long
+	prelude costs little more than the functions that are used.
+
+	With -compile-threads=N, the definitions read since the last top-level
+	expression are generated, optimized and compiled together, on N
+	threads, just before it runs.
+
+	A function can also be run over whole columns of arguments at once by
+	its batch kernel, which the optimizer vectorizes, and -batch-bench
+	times that against calling the function once per row:
+
+	$ echo 'def f(x y) x*x*0.5 + 3*x*y - y*(y<1) + 2;' | ./ch3 -batch-bench=f
+	f_batch: 1048576 rows in 0.861 ms, 1218.1 Mrows/s
+	f: 1048576 calls in 6.420 ms, 163.3 Mrows/s
+	speedup: 7.46x, results identical
+
+	With -batch-threads=N, it also times the kernel run by a BatchExecutor,
+	over chunks of the rows on N threads.
+
+	Calls to the C library's math functions (sin, cos, sqrt, exp, log and
+	others, see extern_table.hpp) are generated as LLVM intrinsics, which
+	the loop vectorizer replaces with glibc's vector versions, from libmvec.
+	Those may differ from the scalar ones in the last bits, and -batch-bench
+	says by how many ulps. -vector-math=false keeps the scalar ones.
+
+	The host functions putchard(x), which prints the character x, and
+	printd(x), which prints x, can be called from any item, with no extern.
+*/
+
+
+// ======   top level parsing and JIT driver
+static llvm::cl::opt<std::string> InputFilename(llvm::cl::Positional,
+	llvm::cl::desc("<input file>"), llvm::cl::init("-"));
+
+static llvm::cl::opt<bool> IterativeParse("iterative-parse",
+	llvm::cl::desc("Parse expressions with an explicit stack instead of "
+		"recursion"));
+
+static llvm::cl::opt<bool> BatchMode("batch",
+	llvm::cl::desc("Print no prompts and no IR; print a summary at the end. "
+		"The default unless the input is a terminal"));
+
+static llvm::cl::opt<bool> PrintIR("print-ir",
+	llvm::cl::desc("Print the IR of each item as it is read. The default "
+		"unless in batch mode"));
+
+static llvm::cl::opt<bool> ErrorLocations("error-locations",
+	llvm::cl::desc("Give the line and column of each error"),
+	llvm::cl::init(true));
+
+static llvm::cl::opt<char> OptLevel("O",
+	llvm::cl::desc("Optimization level: -O0, -O1, -O2 or -O3. The default is "
+		"-O1 for a terminal, to keep the JIT quick, and -O3 in batch mode"),
+	llvm::cl::Prefix, llvm::cl::init(' '));
+
+// BatchMode, PrintIR and OptLevel, or their defaults
+static bool Batch = false;
+static bool ShowIR = true;
+static unsigned Level = 1;
+
+static llvm::cl::opt<std::string> ObjectCacheDir("object-cache",
+	llvm::cl::desc("Keep the object code of each definition in this "
+		"directory, and load it from there when the same definition comes "
+		"again"),
+	llvm::cl::value_desc("dir"));
+
+static llvm::cl::opt<bool> SimplifyAST("simplify",
+	llvm::cl::desc("Fold constants, drop operands that change nothing and "
+		"share repeated subexpressions in the AST before generating code"),
+	llvm::cl::init(true));
+
+static llvm::cl::opt<bool> Lazy("lazy",
+	llvm::cl::desc("Generate and compile each definition only when it is "
+		"first called"));
+
+static llvm::cl::opt<std::string> BatchBench("batch-bench",
+	llvm::cl::desc("At the end of the input, time this function's batch "
+		"kernel over -batch-rows rows of made-up arguments, against a call "
+		"of the function itself for each row"),
+	llvm::cl::value_desc("function"));
+
+static llvm::cl::opt<unsigned> BatchRows("batch-rows",
+	llvm::cl::desc("The number of rows for -batch-bench"),
+	llvm::cl::init(1 << 20));
+
+static llvm::cl::opt<bool> VectorMath("vector-math",
+	llvm::cl::desc("Let the vectorizer call glibc's vector math library, "
+		"libmvec, in batch kernels"),
+	llvm::cl::init(true));
+
+static llvm::cl::opt<unsigned> BatchThreads("batch-threads",
+	llvm::cl::desc("Time -batch-bench's kernel on this many threads too, "
+		"0 for one per core"),
+	llvm::cl::init(1));
+
+static llvm::cl::opt<unsigned> CompileThreads("compile-threads",
+	llvm::cl::desc("Generate, optimize and compile definitions on this many "
+		"threads, all those read since the last top-level expression at "
+		"once, before it is run. 0 for one at a time, as they are read"),
+	llvm::cl::init(0));
+
+// at -O2 and up, a definition with a body this small is imported into the
+// modules that call it, for the inliner. (The decision only looks at the
+// AST, so it is the same when a definition comes from the object cache.)
+static const size_t MaxInlinableNodes = 128;
+
+// set up a parser for this language: the standard binary operators
+static void configure(Parser& P) {
+	P.setBinopPrecedence('<', 10);
+	P.setBinopPrecedence('+', 20);
+	P.setBinopPrecedence('-', 20);
+	P.setBinopPrecedence('*', 40); // highest
+	P.setIterative(IterativeParse);
+	// the items are reported here, once they are generated
+	P.setReportItems(false);
+}
+
+// print Err, if it is one, as an error; returns whether it was
+static bool failed(llvm::Error Err) {
+	if (!Err)
+		return false;
+	llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "Error: ");
+	return true;
+}
+
+// a target machine for an Optimizer at Level to tune for, or nullptr if
+// the host has none, to do without
+static std::unique_ptr<llvm::TargetMachine> createTargetMachine(
+		unsigned Level) {
+	auto TM = KaleidoscopeJIT::createTargetMachine(
+		Optimizer::getCodeGenLevel(Level));
+	if (failed(TM.takeError()))
+		return nullptr;
+	return std::move(*TM);
+}
+
+// ======   host functions
+
+// print the character X, for programs that want to
+static double putchard(double X) {
+	llvm::errs() << char(X);
+	return 0;
+}
+
+// print X on a line of its own
+static double printd(double X) {
+	llvm::errs() << llvm::format("%f\n", X);
+	return 0;
+}
+
+// the bindings of this driver's externs: the math functions, and the host
+// functions above
+static ExternTable createExternTable() {
+	ExternTable Externs;
+	Externs.add("putchard", putchard);
+	Externs.add("printd", printd);
+	return Externs;
+}
+
+// give the host functions in Externs to CG and the JIT; false after an error
+static bool addHostFunctions(const ExternTable& Externs,
+		SymbolTable& Symbols, CodeGen& CG, KaleidoscopeJIT& JIT) {
+	for (const auto& E : Externs.getBindings()) {
+		const ExternTable::Binding& B = E.getValue();
+		if (!B.Address)
+			continue;
+		CG.defineHostFunction(Symbols.intern(E.getKey()), B.NumArgs);
+		if (failed(JIT.addHostFunction(E.getKey(), B.Address)))
+			return false;
+	}
+	return true;
+}
+
+// ======   batch kernel benchmark
+
+// the best of a few runs of Run, in seconds
+template <typename Fn> static double timeBest(Fn Run) {
+	double Best = 0;
+	for (int I = 0; I != 3; ++I) {
+		auto Start = std::chrono::steady_clock::now();
+		Run();
+		std::chrono::duration<double> Time =
+			std::chrono::steady_clock::now() - Start;
+		if (!I || Time.count() < Best)
+			Best = Time.count();
+	}
+	return Best;
+}
+
+// the most ulps by which A[I] and B[I] differ, for any I below N
+static uint64_t getMaxULPs(const double* A, const double* B, size_t N) {
+	// the bits of X, as an integer in the same order as X
+	auto Ordered = [](double X) {
+		uint64_t Bits;
+		memcpy(&Bits, &X, sizeof(Bits));
+		return Bits >> 63 ? ~Bits : Bits | uint64_t(1) << 63;
+	};
+	uint64_t Max = 0;
+	for (size_t I = 0; I != N; ++I) {
+		uint64_t X = Ordered(A[I]), Y = Ordered(B[I]);
+		Max = std::max(Max, X > Y ? X - Y : Y - X);
+	}
+	return Max;
+}
+
+static void printRate(llvm::StringRef Name, size_t N, const char* What,
+		double Seconds) {
+	llvm::outs() << Name << ": " << N << ' ' << What << " in "
+		<< llvm::format("%.3f ms, %.1f Mrows/s\n", Seconds * 1e3,
+			N / Seconds / 1e6);
+}
+
+// set Out[I] to F(Args[0][I], ...), F being a function of Args.size()
+// doubles, for every I below N, calling F through a pointer once a row;
+// false if F has too many arguments
+static bool callPerRow(llvm::JITTargetAddress F,
+		llvm::ArrayRef<const double*> Args, double* Out, size_t N) {
+	switch (Args.size()) {
+	case 0: {
+		auto Fn = reinterpret_cast<double (*)()>(uintptr_t(F));
+		for (size_t I = 0; I != N; ++I)
+			Out[I] = Fn();
+		return true;
+	}
+	case 1: {
+		auto Fn = reinterpret_cast<double (*)(double)>(uintptr_t(F));
+		for (size_t I = 0; I != N; ++I)
+			Out[I] = Fn(Args[0][I]);
+		return true;
+	}
+	case 2: {
+		auto Fn = reinterpret_cast<double (*)(double, double)>(uintptr_t(F));
+		for (size_t I = 0; I != N; ++I)
+			Out[I] = Fn(Args[0][I], Args[1][I]);
+		return true;
+	}
+	case 3: {
+		auto Fn = reinterpret_cast<double (*)(double, double, double)>(
+			uintptr_t(F));
+		for (size_t I = 0; I != N; ++I)
+			Out[I] = Fn(Args[0][I], Args[1][I], Args[2][I]);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+// CodeGenPool -- a CodeGen and an Optimizer for each compile thread that
+// generates code at the same time as the others, made as they are needed.
+// They share the FunctionTable of the main thread's CodeGen, which does not
+// change while they run: the main thread waits for the JIT meanwhile.
+class CodeGenPool {
+	public:
+	struct Worker {
+		CodeGen CG;
+		std::unique_ptr<llvm::TargetMachine> TM;
+		Optimizer Opt;
+
+		Worker(const SymbolTable& Symbols, DiagnosticEngine& Diags,
+				FunctionTable& Table, const llvm::DataLayout& Layout,
+				const ExternTable& Externs, unsigned Level, bool VectorMath)
+			: CG(Symbols, Diags, Table, Layout, &Externs),
+				TM(createTargetMachine(Level)),
+				Opt(Level, TM.get(), VectorMath) {}
+	};
+
+	private:
+	const SymbolTable& Symbols;
+	DiagnosticEngine& Diags;
+	FunctionTable& Table;
+	llvm::DataLayout Layout;
+	const ExternTable& Externs;
+	unsigned Level;
+	bool VectorMath;
+
+	std::mutex Lock;
+	std::vector<std::unique_ptr<Worker>> Workers;
+	std::vector<Worker*> Idle;
+
+	public:
+	CodeGenPool(const SymbolTable& Symbols, DiagnosticEngine& Diags,
+			FunctionTable& Table, const llvm::DataLayout& Layout,
+			const ExternTable& Externs, unsigned Level, bool VectorMath)
+		: Symbols(Symbols), Diags(Diags), Table(Table), Layout(Layout),
+			Externs(Externs), Level(Level), VectorMath(VectorMath) {}
+
+	// a worker for this thread to use until it is released
+	Worker& acquire() {
+		std::lock_guard<std::mutex> L(Lock);
+		if (!Idle.empty()) {
+			Worker* W = Idle.back();
+			Idle.pop_back();
+			return *W;
+		}
+		Workers.push_back(std::make_unique<Worker>(Symbols, Diags, Table,
+			Layout, Externs, Level, VectorMath));
+		return *Workers.back();
+	}
+
+	void release(Worker& W) {
+		std::lock_guard<std::mutex> L(Lock);
+		Idle.push_back(&W);
+	}
+};
+
+// TopLevelHandler -- drives a Parser over top-level items, generates code
+// for each, and runs the top-level expressions on the JIT
+class TopLevelHandler {
+	Parser& P;
+	const SymbolTable& Symbols;
+	CodeGen& CG;
+	Optimizer& Opt;
+	KaleidoscopeJIT& JIT;
+	ObjectFileCache* Cache;
+	CodeGenPool* Pool;
+	Simplifier Simplify;
+	ParseSummary Summary;
+	// the definitions to compile before the next top-level expression, with
+	// -compile-threads
+	std::vector<llvm::StringRef> Pending;
+	// the definition -batch-bench names, once read
+	std::shared_ptr<const FunctionAST> BenchFn;
+	// the compile threads report IR too
+	std::mutex ReportLock;
+
+	void report(const char* What, const llvm::Function& F) {
+		if (!ShowIR)
+			return;
+		std::lock_guard<std::mutex> L(ReportLock);
+		P.errs() << What << '\n';
+		F.print(P.errs());
+		P.errs() << '\n';
+	}
+
+	// optimize G's current module, which holds Fn, with O, unless its
+	// object code is in the cache: then its IR will not be compiled
+	void optimize(CodeGen& G, Optimizer& O, const FunctionAST& Fn) {
+		if (Cache) {
+			uint64_t Key = Cache->getKey(Symbols, G.getFunctionTable(), Fn,
+				G.getImported());
+			ObjectFileCache::setKey(G.getModule(), Key);
+			if (Cache->load(Key))
+				return;
+		}
+		O.run(G.getModule());
+	}
+
+	// Fn's module, generated by G and optimized by O
+	llvm::orc::ThreadSafeModule generate(CodeGen& G, Optimizer& O,
+			const FunctionAST& Fn) {
+		llvm::Function* F = G.emit(Fn);
+		optimize(G, O, Fn);
+		report("Generated function definition:", *F);
+		return G.takeModule();
+	}
+
+	// what generates Fn's module for the JIT, when it wants it. Without a
+	// pool, that is while a top-level expression is being compiled or run,
+	// when CG's current module is a new, empty one: Fn's module is taken
+	// straight back out of it.
+	LazyFunctionUnit::GeneratorFn getGenerator(
+			std::shared_ptr<const FunctionAST> Fn) {
+		return [this, Fn] {
+			if (Lazy)
+				instrument::count(instrument::C_LazyDefinitions);
+			if (!Pool)
+				return generate(CG, Opt, *Fn);
+			CodeGenPool::Worker& W = Pool->acquire();
+			llvm::orc::ThreadSafeModule TSM = generate(W.CG, W.Opt, *Fn);
+			Pool->release(W);
+			return TSM;
+		};
+	}
+
+	// whether Fn is for the inliner to import into its callers
+	bool isInlinable(const FunctionAST& Fn) const {
+		return Opt.inlines() && countNodes(Fn.getBody()) <= MaxInlinableNodes;
+	}
+
+	// hold on to the AST of Fn, which has been defined, if the inliner or
+	// -batch-bench wants it
+	void keep(std::shared_ptr<const FunctionAST> Fn) {
+		if (isInlinable(*Fn))
+			CG.addInlinable(Fn);
+		if (!BatchBench.empty() &&
+				Symbols.getName(Fn->getProto().getName()) == BatchBench)
+			BenchFn = std::move(Fn);
+	}
+
+	bool HandleDefinition(std::unique_ptr<FunctionAST> Fn) {
+		if (Lazy || Pool)
+			return HandleDeferredDefinition(std::move(Fn));
+		llvm::Function* F = CG.codegen(*Fn);
+		if (!F)
+			return false;
+		optimize(CG, Opt, *Fn);
+		report("Read function definition:", *F);
+		keep(std::move(Fn));
+		return !failed(JIT.addModule(CG.takeModule()));
+	}
+
+	// check Fn now, and leave the rest until it is first called, with
+	// -lazy, or else until the next top-level expression
+	bool HandleDeferredDefinition(std::unique_ptr<FunctionAST> Fn) {
+		if (!CG.define(*Fn))
+			return false;
+		std::shared_ptr<const FunctionAST> Shared(std::move(Fn));
+		keep(Shared);
+		llvm::StringRef Name = Symbols.getName(Shared->getProto().getName());
+		if (Lazy)
+			return !failed(JIT.addLazyFunction(Name, getGenerator(Shared)));
+		Pending.push_back(Name);
+		return !failed(JIT.addFunction(Name, getGenerator(Shared)));
+	}
+
+	bool HandleExtern(const PrototypeAST& Proto) {
+		llvm::Function* F = CG.codegen(Proto);
+		if (!F)
+			return false;
+		report("Read extern:", *F);
+		return true;
+	}
+
+	bool HandleTopLevelExpression(const FunctionAST& Fn) {
+		compilePending();
+		llvm::Function* F = CG.codegen(Fn);
+		if (!F)
+			return false;
+		optimize(CG, Opt, Fn);
+		report("Read top-level expression:", *F);
+
+		// the expression's module is only needed until it has run
+		llvm::orc::ResourceTrackerSP RT = JIT.createResourceTracker();
+		if (failed(JIT.addModule(CG.takeModule(), RT)))
+			return false;
+		llvm::Expected<llvm::JITTargetAddress> Addr = [this] {
+			instrument::ScopedTimer Timer(instrument::T_JITCompile);
+			return JIT.lookup("__anon_expr");
+		}();
+		bool Ok = bool(Addr);
+		if (Ok) {
+			auto FP = reinterpret_cast<double (*)()>(uintptr_t(*Addr));
+			llvm::outs() << llvm::format("Evaluated to %f\n", FP());
+			llvm::outs().flush();
+		}
+		else
+			failed(Addr.takeError());
+		return !failed(RT->remove()) && Ok;
+	}
+
+	public:
+	// Cache and Pool may be nullptr, for none
+	TopLevelHandler(Parser& P, const SymbolTable& Symbols, CodeGen& CG,
+			Optimizer& Opt, KaleidoscopeJIT& JIT, ObjectFileCache* Cache,
+			CodeGenPool* Pool)
+		: P(P), Symbols(Symbols), CG(CG), Opt(Opt), JIT(JIT), Cache(Cache),
+			Pool(Pool) {}
+
+	// compile the definitions read since the last top-level expression, on
+	// the compile threads, and wait for them
+	void compilePending() {
+		if (Pending.empty())
+			return;
+		instrument::ScopedTimer Timer(instrument::T_JITCompile);
+		failed(JIT.compile(Pending));
+		Pending.clear();
+	}
+
+	const ParseSummary& getSummary() const { return Summary; }
+
+	// generate and compile the batch kernel of the -batch-bench function, and
+	// time it against the function itself, called once per row; false after
+	// an error
+	bool RunBatchBench() {
+		if (!BenchFn) {
+			llvm::errs() << "Error: -batch-bench: no function '" << BatchBench
+				<< "' was defined\n";
+			return false;
+		}
+		llvm::Function* F = CG.emitBatch(*BenchFn);
+		Opt.runKernel(CG.getModule());
+		report("Generated batch kernel:", *F);
+		if (failed(JIT.addModule(CG.takeModule())))
+			return false;
+		llvm::Expected<llvm::JITTargetAddress> Kernel = [this] {
+			instrument::ScopedTimer Timer(instrument::T_JITCompile);
+			return JIT.lookup(BatchBench + "_batch");
+		}();
+		if (failed(Kernel.takeError()))
+			return false;
+		llvm::Expected<llvm::JITTargetAddress> Scalar = JIT.lookup(BatchBench);
+		if (failed(Scalar.takeError()))
+			return false;
+
+		size_t N = BatchRows;
+		unsigned NumArgs = BenchFn->getProto().getArgs().size();
+		// with -batch-threads, the columns and the parallel run's output are
+		// placed by the executor (see BatchExecutor::place()) before anything
+		// else writes them
+		std::unique_ptr<BatchExecutor> Executor;
+		if (BatchThreads != 1)
+			Executor = std::make_unique<BatchExecutor>(BatchThreads);
+		auto Allocate = [&] {
+			std::unique_ptr<double[]> Column(new double[N]);
+			if (Executor)
+				Executor->place(Column.get(), N);
+			return Column;
+		};
+		std::vector<std::unique_ptr<double[]>> Columns;
+		std::vector<const double*> Args;
+		for (unsigned A = 0; A != NumArgs; ++A) {
+			Columns.push_back(Allocate());
+			for (size_t I = 0; I != N; ++I)
+				Columns[A][I] = double(I * (2 * A + 1) % 1021) / 64 - 8;
+			Args.push_back(Columns[A].get());
+		}
+		std::vector<double> Out(N), Expected(N);
+		auto RunKernel = reinterpret_cast<void (*)(const double* const*,
+			double*, size_t)>(uintptr_t(*Kernel));
+		double KernelTime = timeBest([&] {
+			RunKernel(Args.data(), Out.data(), N);
+		});
+		printRate(BatchBench + "_batch", N, "rows", KernelTime);
+		if (Executor) {
+			std::unique_ptr<double[]> Parallel = Allocate();
+			double Time = timeBest([&] {
+				Executor->run(RunKernel, Args, Parallel.get(), N);
+			});
+			unsigned Threads = Executor->getNumThreads();
+			printRate(BatchBench + "_batch on " + llvm::Twine(Threads).str() +
+				(Threads == 1 ? " thread" : " threads"), N, "rows", Time);
+			if (N && memcmp(Out.data(), Parallel.get(), N * sizeof(double))) {
+				llvm::errs() << "Error: -batch-threads: the results differ\n";
+				return false;
+			}
+		}
+		bool Called = true;
+		double ScalarTime = timeBest([&] {
+			Called = callPerRow(*Scalar, Args, Expected.data(), N);
+		});
+		if (!Called) {
+			llvm::outs() << BatchBench << ": too many arguments to call for "
+				"comparison\n";
+			return true;
+		}
+		printRate(BatchBench, N, "calls", ScalarTime);
+		llvm::outs() << llvm::format("speedup: %.2fx, ",
+			ScalarTime / KernelTime);
+		if (uint64_t ULPs = getMaxULPs(Out.data(), Expected.data(), N))
+			llvm::outs() << "results differ by up to " << ULPs << " ulps\n";
+		else
+			llvm::outs() << "results identical\n";
+		return true;
+	}
+
+	void HandleTopLevelItem() {
+		instrument::ScopedTimer Timer(P.getCurTok() == tok_def
+			? instrument::T_HandleDefinition : P.getCurTok() == tok_extern
+			? instrument::T_HandleExtern : instrument::T_HandleTopLevelExpression);
+		CG.setLocation(P.getTokOffset());
+		TopLevelItem Item = P.ParseTopLevelItem();
+		if (Item.failed() || Item.Kind == TopLevelItem::TK_Semicolon) {
+			Summary.add(Item);
+			return;
+		}
+		if (Item.Function && SimplifyAST)
+			Simplify.run(*Item.Function);
+		bool Ok = Item.Kind == TopLevelItem::TK_Definition
+			? HandleDefinition(std::move(Item.Function))
+			: Item.Kind == TopLevelItem::TK_Extern ? HandleExtern(*Item.Proto)
+			: HandleTopLevelExpression(*Item.Function);
+		if (Ok)
+			Summary.add(Item.Kind);
+		else
+			++Summary.Errors;
+	}
+
+	void MainLoop() {
+		while (true) {
+			if (!Batch)
+				P.errs() << "ready> ";
+			if (P.getCurTok() == tok_eof)
+				break;
+			HandleTopLevelItem();
+		}
+		compilePending();
+	}
+};
+
+// ======   instrumentation
+static llvm::cl::opt<std::string> InstrumentOutput("instrument",
+	llvm::cl::desc("Write the counters and timers of the front end and the "
+		"JIT to this file ('-' for stdout) at exit; needs a build with "
+		"KS_INSTRUMENT"),
+	llvm::cl::value_desc("file"));
+
+static llvm::cl::opt<instrument::ReportFormat> InstrumentFormat(
+	"instrument-format", llvm::cl::desc("The format of the -instrument report"),
+	llvm::cl::values(
+		clEnumValN(instrument::RF_JSON, "json", "counter and timer totals"),
+		clEnumValN(instrument::RF_ChromeTrace, "trace",
+			"a Chrome trace of the timed regions, with the counter totals")),
+	llvm::cl::init(instrument::RF_JSON));
+
+// writes the -instrument report when main returns
+struct InstrumentReport {
+	~InstrumentReport() {
+		if (InstrumentOutput.empty())
+			return;
+		std::error_code EC;
+		llvm::raw_fd_ostream OS(InstrumentOutput, EC, llvm::sys::fs::OF_None);
+		if (EC) {
+			llvm::errs() << "Error: cannot open '" << InstrumentOutput << "': "
+				<< EC.message() << '\n';
+			return;
+		}
+		instrument::writeReport(OS, InstrumentFormat);
+	}
+};
+
+int main(int argc, char** argv)
+{
+	llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
+	if (!InstrumentOutput.empty() && !instrument::Enabled) {
+		llvm::errs() << "Error: -instrument needs a build with KS_INSTRUMENT "
+			"(make INSTRUMENT=1)\n";
+		return 1;
+	}
+	if (OptLevel != ' ' && (OptLevel < '0' || OptLevel > '3')) {
+		llvm::errs() << "Error: invalid optimization level -O" << OptLevel
+			<< '\n';
+		return 1;
+	}
+	Batch = BatchMode.getNumOccurrences() ? bool(BatchMode)
+		: InputFilename != "-" || !llvm::sys::Process::StandardInIsUserInput();
+	ShowIR = PrintIR.getNumOccurrences() ? bool(PrintIR) : !Batch;
+	Level = OptLevel != ' ' ? unsigned(OptLevel - '0') : Batch ? 3 : 1;
+
+	std::unique_ptr<SourceBuffer> Source = InputFilename == "-"
+		? SourceBuffer::openStdin()
+		: SourceBuffer::openFile(InputFilename.c_str());
+	if (!Source) {
+		llvm::errs() << "Error: cannot open '" << InputFilename << "': "
+			<< strerror(errno) << '\n';
+		return 1;
+	}
+
+	InstrumentReport Report;
+	KaleidoscopeJIT::initializeNativeTarget();
+	bool HaveVectorMath = VectorMath && ExternTable::loadVectorMathLibrary();
+	std::unique_ptr<llvm::TargetMachine> TM = createTargetMachine(Level);
+	Optimizer Opt(Level, TM.get(), HaveVectorMath);
+	std::unique_ptr<ObjectFileCache> Cache;
+	if (!ObjectCacheDir.empty())
+		Cache = std::make_unique<ObjectFileCache>(ObjectCacheDir, Level,
+			SimplifyAST);
+	llvm::Expected<std::unique_ptr<KaleidoscopeJIT>> JIT =
+		KaleidoscopeJIT::create(Opt.getCodeGenLevel(), Cache.get(),
+			CompileThreads);
+	if (failed(JIT.takeError()))
+		return 1;
+
+	SymbolTable Symbols;
+	LineIndex Lines(*Source);
+	DiagnosticEngine Diags(llvm::errs(), Source.get(),
+		ErrorLocations ? &Lines : nullptr);
+	Lexer Lex(*Source, Symbols, Diags);
+	Parser P(Lex, Diags);
+	configure(P);
+	ExternTable Externs = createExternTable();
+	FunctionTable Functions;
+	CodeGen CG(Symbols, Diags, Functions, (*JIT)->getDataLayout(), &Externs);
+	if (!addHostFunctions(Externs, Symbols, CG, **JIT))
+		return 1;
+	std::unique_ptr<CodeGenPool> Pool;
+	if (CompileThreads)
+		Pool = std::make_unique<CodeGenPool>(Symbols, Diags, Functions,
+			(*JIT)->getDataLayout(), Externs, Level, HaveVectorMath);
+	TopLevelHandler H(P, Symbols, CG, Opt, **JIT, Cache.get(), Pool.get());
+
+	if (!Batch)
+		llvm::errs() << "ready> ";
+	P.getNextToken();
+	H.MainLoop();
+	if (Batch)
+		H.getSummary().print(llvm::errs());
+	if (!BatchBench.empty() && !H.RunBatchBench())
+		return 1;
+	return 0;
+}
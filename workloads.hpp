@@ -0,0 +1,216 @@
+#ifndef KALEIDOSCOPE_WORKLOADS_HPP
+#define KALEIDOSCOPE_WORKLOADS_HPP
+
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+#include <string>
+
+// Synthetic workloads
+//
+// Generators for Kaleidoscope sources that stress one part of the front
+// end each. Every generator appends whole top-level items to Out until it
+// holds at least Size bytes, and is deterministic: the same Seed gives
+// the same source. The sources only use the operators the drivers
+// install (< + - *) and parse without errors, except for the malformed
+// ones at the end, which are for stress tests of error handling.
+
+// a small linear congruential generator, so the sources don't depend on
+// the library's
+class WorkloadRandom {
+	uint64_t State;
+	public:
+	explicit WorkloadRandom(uint64_t Seed) : State(Seed * 2 + 1) {}
+	// a number in [0, N)
+	unsigned next(unsigned N) {
+		State = State * 6364136223846793005ULL + 1442695040888963407ULL;
+		return unsigned(State >> 33) % N;
+	}
+};
+
+inline char randomOp(WorkloadRandom& R) {
+	static const char Ops[] = {'<', '+', '-', '*'};
+	return Ops[R.next(4)];
+}
+
+inline void randomOperand(llvm::raw_ostream& OS, WorkloadRandom& R) {
+	if (R.next(2))
+		OS << "x" << R.next(64);
+	else
+		OS << R.next(1000);
+}
+
+// long operator chains: top-level expressions of Length binary operators
+inline void genOperatorChains(std::string& Out, size_t Size, uint64_t Seed,
+		unsigned Length = 1000) {
+	WorkloadRandom R(Seed);
+	llvm::raw_string_ostream OS(Out);
+	while (OS.tell() < Size) {
+		randomOperand(OS, R);
+		for (unsigned I = 0; I != Length; ++I) {
+			OS << ' ' << randomOp(R) << ' ';
+			randomOperand(OS, R);
+		}
+		OS << ";\n";
+	}
+}
+
+// deep parens: top-level expressions nested Depth parentheses deep, with
+// an operator at each level
+inline void genDeepParens(std::string& Out, size_t Size, uint64_t Seed,
+		unsigned Depth = 1000) {
+	WorkloadRandom R(Seed);
+	llvm::raw_string_ostream OS(Out);
+	while (OS.tell() < Size) {
+		for (unsigned I = 0; I != Depth; ++I)
+			OS << '(';
+		randomOperand(OS, R);
+		for (unsigned I = 0; I != Depth; ++I) {
+			OS << ' ' << randomOp(R) << ' ';
+			randomOperand(OS, R);
+			OS << ')';
+		}
+		OS << ";\n";
+	}
+}
+
+// wide calls: top-level calls with Width arguments each
+inline void genWideCalls(std::string& Out, size_t Size, uint64_t Seed,
+		unsigned Width = 256) {
+	WorkloadRandom R(Seed);
+	llvm::raw_string_ostream OS(Out);
+	while (OS.tell() < Size) {
+		OS << "f" << R.next(16) << '(';
+		for (unsigned I = 0; I != Width; ++I) {
+			if (I)
+				OS << ", ";
+			randomOperand(OS, R);
+		}
+		OS << ");\n";
+	}
+}
+
+// many small defs: short definitions of one to three arguments
+inline void genManyDefs(std::string& Out, size_t Size, uint64_t Seed) {
+	WorkloadRandom R(Seed);
+	llvm::raw_string_ostream OS(Out);
+	for (unsigned N = 0; OS.tell() < Size; ++N) {
+		unsigned NumArgs = 1 + R.next(3);
+		OS << "def fn" << N << '(';
+		for (unsigned I = 0; I != NumArgs; ++I)
+			OS << (I ? " " : "") << "x" << I;
+		OS << ")\n\tx0 " << randomOp(R) << ' ' << R.next(100);
+		for (unsigned I = 1; I != NumArgs; ++I)
+			OS << ' ' << randomOp(R) << " x" << I;
+		OS << ";\n";
+	}
+}
+
+// many externs: declarations of zero to four arguments
+inline void genManyExterns(std::string& Out, size_t Size, uint64_t Seed) {
+	WorkloadRandom R(Seed);
+	llvm::raw_string_ostream OS(Out);
+	for (unsigned N = 0; OS.tell() < Size; ++N) {
+		unsigned NumArgs = R.next(5);
+		OS << "extern ext" << N << '(';
+		for (unsigned I = 0; I != NumArgs; ++I)
+			OS << (I ? " " : "") << "a" << I;
+		OS << ");\n";
+	}
+}
+
+// numeric tables: rows of constants of assorted lengths, passed to a call
+inline void genNumericTables(std::string& Out, size_t Size, uint64_t Seed,
+		unsigned Columns = 8) {
+	WorkloadRandom R(Seed);
+	llvm::raw_string_ostream OS(Out);
+	while (OS.tell() < Size) {
+		OS << "row(";
+		for (unsigned I = 0; I != Columns; ++I) {
+			if (I)
+				OS << ", ";
+			switch (R.next(4)) {
+			case 0:
+				OS << R.next(100);
+				break;
+			case 1:
+				OS << R.next(100000) << '.' << R.next(100);
+				break;
+			case 2:
+				OS << "0." << llvm::format("%06u", R.next(1000000));
+				break;
+			default:
+				OS << R.next(1000) << llvm::format("%06u", R.next(1000000)) << '.'
+					<< llvm::format("%09u", R.next(1000000000));
+				break;
+			}
+		}
+		OS << ");\n";
+	}
+}
+
+// ======   malformed sources
+
+// unclosed parens: top-level expressions that open Depth parentheses and
+// close none of them
+inline void genUnclosedParens(std::string& Out, size_t Size, uint64_t Seed,
+		unsigned Depth = 1000) {
+	WorkloadRandom R(Seed);
+	llvm::raw_string_ostream OS(Out);
+	while (OS.tell() < Size) {
+		for (unsigned I = 0; I != Depth; ++I) {
+			OS << '(';
+			randomOperand(OS, R);
+			OS << ' ' << randomOp(R) << ' ';
+		}
+		OS << ";\n";
+	}
+}
+
+// bad numbers: expressions of literals with too many points, like
+// "1.2.3.4", each a lexical error
+inline void genBadNumbers(std::string& Out, size_t Size, uint64_t Seed) {
+	WorkloadRandom R(Seed);
+	llvm::raw_string_ostream OS(Out);
+	while (OS.tell() < Size) {
+		unsigned Parts = 2 + R.next(6);
+		for (unsigned I = 0; I != Parts; ++I)
+			OS << (I ? "." : "") << R.next(1000);
+		OS << ' ' << randomOp(R) << " .;\n";
+	}
+}
+
+// long tokens: identifiers and number literals of Length characters each
+inline void genLongTokens(std::string& Out, size_t Size, uint64_t Seed,
+		unsigned Length = 4096) {
+	WorkloadRandom R(Seed);
+	llvm::raw_string_ostream OS(Out);
+	while (OS.tell() < Size) {
+		OS << 'x';
+		for (unsigned I = 1; I != Length; ++I)
+			OS << char('a' + R.next(26));
+		OS << " + ";
+		for (unsigned I = 0; I != Length; ++I)
+			OS << char(I == Length / 2 ? '.' : '0' + R.next(10));
+		OS << ";\n";
+	}
+}
+
+// token soup: random sequences of the language's tokens, mostly not in
+// the grammar's order
+inline void genTokenSoup(std::string& Out, size_t Size, uint64_t Seed) {
+	static const char* const Tokens[] = {
+		"def", "extern", "x", "f", "1", "2.5", ".", "(", ")", ",", ";", "<",
+		"+", "-", "*", "/", "#\n", "\n", "1.2.3"
+	};
+	const unsigned NumTokens = sizeof(Tokens) / sizeof(Tokens[0]);
+	WorkloadRandom R(Seed);
+	llvm::raw_string_ostream OS(Out);
+	while (OS.tell() < Size) {
+		for (unsigned I = 0; I != 64; ++I)
+			OS << Tokens[R.next(NumTokens)] << ' ';
+		OS << ";\n";
+	}
+}
+
+#endif